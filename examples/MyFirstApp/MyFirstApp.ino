@@ -16,22 +16,32 @@
 
   const char* app_setting(const char *tag, const byte *value, size_t len)
   { // Called for settings retrieved from EEPROM, return PSTR for tag if setting is OK
-#define s(n) do{const char *t=PSTR(#n);if(!strcmp_P(tag,t)){n=(const char *)value;return t;}}while(0)
-    app_settings
+    switch (revk_hash(tag))
+    { // One hash and one compare per setting
+#define s(n) revk_setting_s(n)
+      app_settings
 #undef s
+    }
     return NULL; // Failed
   }
 
   boolean app_command(const char*tag, const byte *message, size_t len)
-  { // Called for incoming MQTT messages, return true if message is OK
+  { // Called for incoming MQTT messages with no registered handler, return true if message is OK
     return false; // Failed
   }
 
+  boolean command_hello(const char*tag, const byte *message, size_t len)
+  { // Registered in setup, called for command/MyFirstApp/hostname/hello
+    revk.info(F("hello"),F("Hello %.*s"),len,message);
+    return true;
+  }
+
   void setup()
   { // Your set up here as usual
 	Serial.begin(115200);
 	Serial.printf_P(PSTR("Setting 1 is %s\n"),mysetting1?:"[unset]");
 	Serial.printf_P(PSTR("Setting 2 is %s\n"),mysetting2?:"[unset]");
+	revk.command(F("hello"),command_hello);
   }
 
   void loop()
@@ -0,0 +1,101 @@
+// Host simulation of the ESPRevK reconnect backoff, showing when N nodes reconnect after a broker restart
+// Build: g++ -O2 -o backoffsim backoffsim.cpp
+// Usage: backoffsim [nodes [down-ms [retrymin [retrymax]]]]
+// The broker goes away at 0 and is back at down-ms, each node tries at the delays backoff() gives, as in loop()
+// A try before the broker is back fails, and the node backs off again from its last delay
+// Output is a histogram of successful connects in 100ms slots, and of all tries, to show there are no lock-step waves
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+static long retrymin = 1000;
+static long retrymax = 30000;
+
+static uint32_t r;              // Per node, as each node has its own jitter() state
+
+static uint32_t
+jitter ()
+{                               // Same as ESPRevK.cpp
+   r ^= r << 13;                // xorshift32
+   r ^= r >> 17;
+   r ^= r << 5;
+   return r;
+}
+
+static long
+backoff (long *prev)
+{                               // Same as ESPRevK.cpp
+   uint32_t r = jitter ();
+   long lo = (retrymin > 0 ? retrymin : 1),
+      hi = (*prev > lo ? *prev : lo) * 3;
+   if (hi > retrymax)
+      hi = retrymax;
+   if (hi <= lo)
+      hi = lo + 1;
+   return *prev = lo + r % (hi - lo);
+}
+
+#define	SLOT	100             // ms per histogram slot
+
+int
+main (int argc, const char *argv[])
+{
+   int nodes = (argc > 1 ? atoi (argv[1]) : 500);
+   long down = (argc > 2 ? atol (argv[2]) : 5000);
+   if (argc > 3)
+      retrymin = atol (argv[3]);
+   if (argc > 4)
+      retrymax = atol (argv[4]);
+   long end = down + retrymax * 2;
+   int slots = end / SLOT + 1;
+   int *ok = (int *) calloc (slots, sizeof (int));
+   int *tries = (int *) calloc (slots, sizeof (int));
+   long last = 0;
+   int n;
+   for (n = 0; n < nodes; n++)
+   {
+      uint32_t chipid = 0x100000 + n * 7919;    // Chip IDs are not random, but differ
+      r = (chipid * 2654435761U) | 1;
+      long mqttdelay = 0;       // As set by loop() on disconnect
+      long t = 0;
+      while (1)
+      {
+         t += backoff (&mqttdelay);
+         if (t / SLOT < slots)
+            tries[t / SLOT]++;
+         if (t >= down)
+            break;              // Connected
+      }
+      if (t / SLOT < slots)
+         ok[t / SLOT]++;
+      if (t > last)
+         last = t;
+   }
+   int peak = 0,
+      peaktries = 0,
+      s;
+   for (s = 0; s < slots; s++)
+   {
+      if (ok[s] > peak)
+         peak = ok[s];
+      if (tries[s] > peaktries)
+         peaktries = tries[s];
+   }
+   printf ("%d nodes, broker down %ldms, retrymin %ldms, retrymax %ldms\n", nodes, down, retrymin, retrymax);
+   printf ("All connected by %ldms, peak %d connects and %d tries in %dms\n", last, peak, peaktries, SLOT);
+   for (s = 0; s < slots && s * SLOT <= last; s++)
+   {
+      if (!tries[s])
+         continue;
+      char bar[61];
+      int l = (peaktries ? tries[s] * 60 / peaktries : 0);
+      memset (bar, '#', l);
+      bar[l] = 0;
+      printf ("%6ld %4d %4d %s\n", (long) s * SLOT, ok[s], tries[s], bar);
+   }
+   free (ok);
+   free (tries);
+   return 0;
+}
@@ -0,0 +1,243 @@
+// Host micro-benchmark of ESPRevK settings lookup, tag hash against the old strcasecmp chain and list
+// Build: g++ -O2 -o hashbench hashbench.cpp
+// Usage: hashbench [lookups [appsettings]]
+// Local settings are the revk_settings list in ESPRevK.h, plus appsettings (default 20) app tags that come after them
+// Apply: finding which setting a tag is, old is a strcasecmp per local setting in turn (app tags go through them all),
+// new is revk_hash and a switch on it (as localsetting and the revk_setting_x macros), then one strcasecmp to confirm
+// Find: finding the stored setting, old walks a list with strcmp, new is a binary search of the table sorted by hash
+// (as setting_find), then strcasecmp for same hash, the tags looked up are a mix of all of them
+// Host times are only a guide, on the ESP8266 tags are PROGMEM (strcasecmp_P) so each compare costs more, which is
+// why compares per lookup are shown too
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+constexpr uint32_t
+revk_hash (const char *t, uint32_t h = 2166136261U)
+{                               // Same as ESPRevK.h
+   return *t ? revk_hash (t + 1, (h ^ (uint8_t) (*t >= 'A' && *t <= 'Z' ? *t + 'a' - 'A' : *t)) * 16777619U) : h;
+}
+
+// Same tags as revk_settings in ESPRevK.h
+#define revk_settings	\
+t(hostname) t(otahost) t(otasha1) t(wifireset) t(wifissid) t(wifibssid) t(wifichan) t(wifipass) \
+t(wifissid2) t(wifibssid2) t(wifichan2) t(wifipass2) t(wifissid3) t(wifibssid3) t(wifichan3) t(wifipass3) \
+t(mqttreset) t(mqtthost) t(mqtthost2) t(mqtthost3) t(mqttsha1) t(mqttsha12) t(mqttsha13) t(mqttuser) t(mqttpass) \
+t(mqttport) t(ntphost) t(prefixcommand) t(prefixsetting) t(prefixstate) t(prefixevent) t(prefixinfo) t(prefixerror) \
+t(timezone) t(statecache) t(retrymin) t(retrymax) t(roammargin) t(roammin)
+
+static const char *local[] = {
+#define t(n) #n,
+   revk_settings
+#undef t
+};
+
+#define	LOCALS	(sizeof (local) / sizeof (*local))
+#define	MAXTAGS	300
+
+static const char *tags[MAXTAGS];       // All, local then app
+static unsigned int ntags = 0;
+static unsigned long compares = 0;
+
+static int
+cmp (const char *a, const char *b)
+{                               // Counted strcasecmp_P
+   compares++;
+   return strcasecmp (a, b);
+}
+
+static const char *
+oldapply (const char *tag)
+{                               // As the old s()/n()/f() macros, strcasecmp_P for each in turn
+#define t(n) if (!cmp (tag, #n)) return #n;
+   revk_settings
+#undef t
+      return NULL;
+}
+
+static const char *
+newapply (const char *tag)
+{                               // As localsetting, switch on hash, then confirm
+   switch (revk_hash (tag))
+   {
+#define t(n) case revk_hash (#n): if (cmp (tag, #n)) break; return #n;
+      revk_settings
+#undef t
+   }
+   return NULL;
+}
+
+// Old stored settings, linked list in order added
+typedef struct old_s old_t;
+struct old_s
+{
+   old_t *next;
+   const char *tag;
+};
+static old_t *oldset = NULL;
+
+static old_t *
+oldfind (const char *tag)
+{                               // As old setting_apply, strcmp_P along list
+   old_t *s;
+   for (s = oldset; s && cmp (tag, s->tag); s = s->next);
+   return s;
+}
+
+// New stored settings, table sorted by hash
+typedef struct setting_s setting_t;
+struct setting_s
+{
+   uint32_t hash;
+   const char *tag;
+};
+static setting_t set[MAXTAGS];
+static unsigned int setcount = 0;
+
+static setting_t *
+setting_find (const char *tag, uint32_t hash, unsigned int *pos)
+{                               // Same as ESPRevK.cpp
+   unsigned int lo = 0,
+      hi = setcount;
+   while (lo < hi)
+   {
+      unsigned int m = (lo + hi) / 2;
+      if (set[m].hash < hash)
+         lo = m + 1;
+      else
+         hi = m;
+   }
+   *pos = lo;
+   for (; lo < setcount && set[lo].hash == hash; lo++)
+      if (!cmp (tag, set[lo].tag))
+      {
+         *pos = lo;
+         return set + lo;
+      }
+   return NULL;
+}
+
+static setting_t *
+newfind (const char *tag)
+{
+   unsigned int pos;
+   return setting_find (tag, revk_hash (tag), &pos);
+}
+
+static double
+now ()
+{
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static volatile const void *sink;
+
+static void
+bench (const char *name, const void *(*f) (const char *), unsigned int *order, long lookups)
+{                               // Run f for tags in order, report ns and compares per lookup
+   compares = 0;
+   double start = now ();
+   for (long i = 0; i < lookups; i++)
+      sink = f (tags[order[i % ntags]]);
+   double t = now () - start;
+   printf ("%-12s %8.1f ns %6.2f compares\n", name, t * 1e9 / lookups, (double) compares / lookups);
+}
+
+static const void *
+oldapplyv (const char *tag)
+{
+   return oldapply (tag);
+}
+
+static const void *
+newapplyv (const char *tag)
+{
+   return newapply (tag);
+}
+
+static const void *
+oldfindv (const char *tag)
+{
+   return oldfind (tag);
+}
+
+static const void *
+newfindv (const char *tag)
+{
+   return newfind (tag);
+}
+
+int
+main (int argc, const char *argv[])
+{
+   long lookups = (argc > 1 ? atol (argv[1]) : 10000000);
+   int apps = (argc > 2 ? atoi (argv[2]) : 20);
+   if (apps < 0 || LOCALS + apps > MAXTAGS || lookups <= 0)
+   {
+      fprintf (stderr, "Bad args\n");
+      return 1;
+   }
+   unsigned int i;
+   for (i = 0; i < LOCALS; i++)
+      tags[ntags++] = local[i];
+   for (int a = 0; a < apps; a++)
+   {
+      char *t = (char *) malloc (12);
+      snprintf (t, 12, "app%d", a);
+      tags[ntags++] = t;
+   }
+   // Stored settings, all of them, list in order, table sorted
+   old_t *list = (old_t *) calloc (ntags, sizeof (old_t));
+   for (i = ntags; i--;)
+   {
+      list[i].tag = tags[i];
+      list[i].next = oldset;
+      oldset = &list[i];
+   }
+   for (i = 0; i < ntags; i++)
+   {
+      unsigned int pos;
+      uint32_t h = revk_hash (tags[i]);
+      setting_find (tags[i], h, &pos);
+      memmove (set + pos + 1, set + pos, (setcount - pos) * sizeof (*set));
+      set[pos].hash = h;
+      set[pos].tag = tags[i];
+      setcount++;
+   }
+   // Check they agree
+   for (i = 0; i < ntags; i++)
+      if (oldapply (tags[i]) != newapply (tags[i]) || !newfind (tags[i]) || newfind (tags[i])->tag != oldfind (tags[i])->tag)
+      {
+         fprintf (stderr, "Mismatch for %s\n", tags[i]);
+         return 1;
+      }
+   // Random order of lookups
+   unsigned int *order = (unsigned int *) malloc (ntags * sizeof (*order));
+   uint32_t r = 1;
+   for (i = 0; i < ntags; i++)
+      order[i] = i;
+   for (i = ntags; i > 1; i--)
+   {
+      r ^= r << 13;
+      r ^= r >> 17;
+      r ^= r << 5;
+      unsigned int j = r % i,
+         x = order[i - 1];
+      order[i - 1] = order[j];
+      order[j] = x;
+   }
+   printf ("%u local and %d app settings, %ld lookups\n", (unsigned int) LOCALS, apps, lookups);
+   bench ("Apply old", oldapplyv, order, lookups);
+   bench ("Apply hash", newapplyv, order, lookups);
+   bench ("Find old", oldfindv, order, lookups);
+   bench ("Find hash", newfindv, order, lookups);
+   free (order);
+   free (list);
+   return 0;
+}
@@ -0,0 +1,393 @@
+// Host tool to make (and check) a delta for the ESPRevK upgrade and otamqtt commands
+// Build: g++ -O2 -o otadelta otadelta.cpp
+// Usage: otadelta old.bin new.bin [patch]      Make patch (default name is new.bin.<md5 of old>.delta, as upgrade fetches)
+//        otadelta -a old.bin patch [new.bin]   Apply patch, and check against new.bin if given
+// old.bin must be the image that is running (ESP.getSketchMD5 is the MD5 of it), new.bin the one to upgrade to
+// A patch is always checked after it is made, by applying it to old.bin the same way otawrite() does, in random size pieces
+//
+// Format (see ESPRevK.cpp) is "RDP1", MD5 of old image, MD5 of new image, new size, then records of :-
+// 'C' offset len       Copy len bytes from old image at offset
+// 'I' len data         Insert len bytes of data
+// Numbers are 32 bits little endian, records are applied in order so the new image is written sequentially
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+typedef uint8_t byte;
+typedef std::vector < byte > bytes;
+
+#define	HEAD		40      // Header size
+#define	MATCHKEY	8       // Bytes hashed to find a match
+#define	MATCHMIN	16      // Smallest copy worth a record (a copy record is 9 bytes, and splits an insert)
+#define	HASHBITS	20
+
+static void
+md5 (const byte * msg, size_t len, byte out[16])
+{                               // RFC 1321
+   static const uint32_t k[64] = {
+      0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+      0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+      0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+      0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+      0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+      0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+      0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+      0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+   };
+   static const byte r[64] = {
+      7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+      4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+   };
+   uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+   bytes m (msg, msg + len);
+   m.push_back (0x80);
+   while (m.size () % 64 != 56)
+      m.push_back (0);
+   for (int i = 0; i < 8; i++)
+      m.push_back ((uint64_t) len * 8 >> (i * 8));
+   for (size_t o = 0; o < m.size (); o += 64)
+   {
+      uint32_t w[16],
+        a = h[0],
+         b = h[1],
+         c = h[2],
+         d = h[3];
+      for (int i = 0; i < 16; i++)
+         w[i] = m[o + i * 4] | (m[o + i * 4 + 1] << 8) | (m[o + i * 4 + 2] << 16) | ((uint32_t) m[o + i * 4 + 3] << 24);
+      for (int i = 0; i < 64; i++)
+      {
+         uint32_t f;
+         int g;
+         if (i < 16)
+         {
+            f = (b & c) | (~b & d);
+            g = i;
+         } else if (i < 32)
+         {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+         } else if (i < 48)
+         {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+         } else
+         {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+         }
+         uint32_t t = d;
+         d = c;
+         c = b;
+         f += a + k[i] + w[g];
+         b += (f << r[i]) | (f >> (32 - r[i]));
+         a = t;
+      }
+      h[0] += a;
+      h[1] += b;
+      h[2] += c;
+      h[3] += d;
+   }
+   for (int i = 0; i < 16; i++)
+      out[i] = h[i / 4] >> ((i % 4) * 8);
+}
+
+static std::string
+hex (const byte * p, int l)
+{
+   std::string s;
+   char x[3];
+   while (l--)
+   {
+      sprintf (x, "%02x", *p++);
+      s += x;
+   }
+   return s;
+}
+
+static uint32_t
+le32 (const byte * p)
+{                               // Same as ESPRevK.cpp
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void
+put32 (bytes & b, uint32_t v)
+{
+   for (int i = 0; i < 4; i++)
+      b.push_back (v >> (i * 8));
+}
+
+static uint32_t
+key (const byte * p)
+{                               // Hash of MATCHKEY bytes
+   uint32_t h = 0;
+   for (int i = 0; i < MATCHKEY; i++)
+      h = (h * 0x01000193) ^ p[i];
+   return (h * 2654435761U) >> (32 - HASHBITS);
+}
+
+static void
+insert (bytes & patch, const bytes & n, size_t from, size_t to)
+{
+   if (to <= from)
+      return;
+   patch.push_back ('I');
+   put32 (patch, to - from);
+   patch.insert (patch.end (), n.begin () + from, n.begin () + to);
+}
+
+static bytes
+make (const bytes & o, const bytes & n, int *copies, int *inserts)
+{                               // Greedy, copy from old where there is a long enough match, else insert
+   bytes patch (HEAD);
+   memcpy (&patch[0], "RDP1", 4);
+   md5 (o.data (), o.size (), &patch[4]);
+   md5 (n.data (), n.size (), &patch[20]);
+   for (int i = 0; i < 4; i++)
+      patch[36 + i] = n.size () >> (i * 8);
+   std::vector < int32_t > table (1 << HASHBITS, -1);   // Last old offset for each key
+   for (size_t i = 0; i + MATCHKEY <= o.size (); i++)
+      table[key (&o[i])] = i;
+   size_t pos = 0,
+      lit = 0,                  // Start of data not yet in a record
+      next = 0;                 // Old offset following last copy, code that has only moved tends to match here
+   *copies = *inserts = 0;
+   while (pos + MATCHKEY <= n.size ())
+   {
+      size_t best = 0,
+         bestlen = 0;
+      int32_t cand[2] = { (int32_t) next, table[key (&n[pos])] };
+      for (int c = 0; c < 2; c++)
+      {
+         if (cand[c] < 0 || (size_t) cand[c] >= o.size ())
+            continue;
+         size_t l = 0;
+         while (pos + l < n.size () && cand[c] + l < o.size () && n[pos + l] == o[cand[c] + l])
+            l++;
+         if (l > bestlen)
+         {
+            best = cand[c];
+            bestlen = l;
+         }
+      }
+      if (bestlen < MATCHMIN)
+      {
+         pos++;
+         continue;
+      }
+      if (lit < pos)
+         (*inserts)++;
+      insert (patch, n, lit, pos);
+      patch.push_back ('C');
+      put32 (patch, best);
+      put32 (patch, bestlen);
+      (*copies)++;
+      pos += bestlen;
+      lit = pos;
+      next = best + bestlen;
+   }
+   if (lit < n.size ())
+      (*inserts)++;
+   insert (patch, n, lit, n.size ());
+   return patch;
+}
+
+typedef struct apply_s apply_t;
+struct apply_s
+{                               // State as otawrite() in ESPRevK.cpp
+   const bytes *old;            // Running image
+   bytes out;                   // Update
+   bool running;                // Update.begin() done
+   uint32_t size;               // Update size, from header
+   byte md5[16];                // Update.setMD5()
+   byte patch[HEAD];
+   byte patchlen;
+   uint32_t insert;
+};
+
+static const char *
+copy (apply_t * a, uint32_t from, uint32_t len)
+{                               // As otacopy()
+   if (from + len < from || from + len > a->old->size ())
+      return "Bad copy";
+   a->out.insert (a->out.end (), a->old->begin () + from, a->old->begin () + from + len);
+   return NULL;
+}
+
+static const char *
+write (apply_t * a, const byte * p, size_t l)
+{                               // As otawrite()
+   while (l)
+   {
+      if (a->insert)
+      {
+         size_t n = (l < a->insert ? l : a->insert);
+         a->out.insert (a->out.end (), p, p + n);
+         p += n;
+         l -= n;
+         a->insert -= n;
+         continue;
+      }
+      a->patch[a->patchlen++] = *p++;
+      l--;
+      if (!a->running)
+      {                         // Header
+         if (a->patchlen < HEAD)
+            continue;
+         if (memcmp (a->patch, "RDP1", 4))
+            return "Bad delta";
+         byte m[16];
+         md5 (a->old->data (), a->old->size (), m);
+         if (memcmp (m, a->patch + 4, 16))
+            return "Delta mismatch";
+         a->running = true;
+         a->size = le32 (a->patch + 36);
+         memcpy (a->md5, a->patch + 20, 16);
+      } else if (a->patch[0] == 'C')
+      {
+         if (a->patchlen < 9)
+            continue;
+         const char *e = copy (a, le32 (a->patch + 1), le32 (a->patch + 5));
+         if (e)
+            return e;
+      } else if (a->patch[0] == 'I')
+      {
+         if (a->patchlen < 5)
+            continue;
+         a->insert = le32 (a->patch + 1);
+      } else
+         return "Bad delta";
+      a->patchlen = 0;
+   }
+   return NULL;
+}
+
+static const char *
+apply (const bytes & o, const bytes & patch, bytes & n)
+{                               // Apply in random size pieces, as received over HTTP or MQTT, returns error or NULL
+   apply_t a;
+   memset (&a.md5, 0, sizeof (a.md5));
+   a.old = &o;
+   a.running = false;
+   a.size = 0;
+   a.patchlen = 0;
+   a.insert = 0;
+   size_t pos = 0;
+   while (pos < patch.size ())
+   {
+      size_t l = 1 + rand () % 1500;
+      if (l > patch.size () - pos)
+         l = patch.size () - pos;
+      const char *e = write (&a, &patch[pos], l);
+      if (e)
+         return e;
+      pos += l;
+   }
+   if (!a.running)
+      return "Short delta";
+   if (a.insert || a.patchlen)
+      return "Short delta";
+   if (a.out.size () != a.size)
+      return "Wrong size";      // Update.end()
+   byte m[16];
+   md5 (a.out.data (), a.out.size (), m);
+   if (memcmp (m, a.md5, 16))
+      return "MD5 mismatch";    // Update.end()
+   n = a.out;
+   return NULL;
+}
+
+static bool
+readfile (const char *name, bytes & b)
+{
+   FILE *f = fopen (name, "rb");
+   if (!f)
+   {
+      perror (name);
+      return false;
+   }
+   byte buf[4096];
+   size_t l;
+   b.clear ();
+   while ((l = fread (buf, 1, sizeof (buf), f)) > 0)
+      b.insert (b.end (), buf, buf + l);
+   fclose (f);
+   return true;
+}
+
+static bool
+writefile (const char *name, const bytes & b)
+{
+   FILE *f = fopen (name, "wb");
+   if (!f || fwrite (b.data (), 1, b.size (), f) != b.size () || fclose (f))
+   {
+      perror (name);
+      return false;
+   }
+   return true;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   srand (1);
+   bytes o,
+     n,
+     patch,
+     check;
+   if (argc >= 4 && !strcmp (argv[1], "-a"))
+   {                            // Apply
+      if (!readfile (argv[2], o) || !readfile (argv[3], patch))
+         return 1;
+      const char *e = apply (o, patch, check);
+      if (e)
+      {
+         fprintf (stderr, "%s\n", e);
+         return 1;
+      }
+      if (argc > 4)
+      {
+         if (!readfile (argv[4], n))
+            return 1;
+         if (n != check)
+         {
+            fprintf (stderr, "Does not match %s\n", argv[4]);
+            return 1;
+         }
+      }
+      printf ("OK, %u bytes\n", (unsigned) check.size ());
+      return 0;
+   }
+   if (argc < 3 || argc > 4)
+   {
+      fprintf (stderr, "Usage: %s old.bin new.bin [patch]\n       %s -a old.bin patch [new.bin]\n", argv[0], argv[0]);
+      return 1;
+   }
+   if (!readfile (argv[1], o) || !readfile (argv[2], n))
+      return 1;
+   int copies,
+     inserts;
+   patch = make (o, n, &copies, &inserts);
+   const char *e = apply (o, patch, check);
+   if (!e && check != n)
+      e = "Does not match";
+   if (e)
+   {                            // Bug in make()
+      fprintf (stderr, "Check failed: %s\n", e);
+      return 1;
+   }
+   std::string name;
+   if (argc > 3)
+      name = argv[3];
+   else
+      name = std::string (argv[2]) + "." + hex (&patch[4], 16) + ".delta";
+   if (!writefile (name.c_str (), patch))
+      return 1;
+   printf ("%s %u bytes (%u%% of %u), %d copies, %d inserts, checked\n", name.c_str (), (unsigned) patch.size (),
+           (unsigned) (patch.size () * 100 / (n.size ()? : 1)), (unsigned) n.size (), copies, inserts);
+   return 0;
+}
@@ -0,0 +1,609 @@
+// Host tool to send an image (or delta) to a device with the ESPRevK otamqtt command, over MQTT
+// Build: g++ -O2 -o otamqtt otamqtt.cpp
+// Usage: otamqtt [-h broker] [-p port] [-u user] [-P pass] [-l loss%] app hostname file
+// e.g.   otamqtt -h mqtt.local MyFirstApp 1A2B3C MyFirstApp.ino.generic.bin
+// A file starting "RDP1" (from otadelta) is sent as a delta, which has to be for the image the device is running
+// Broker is plain MQTT 3.1.1 (no TLS), topics are the default prefixes, command/app/hostname/otamqtt and so on
+// With broker "-" there is no network, the broker and device are a stand-in in this program, running the same sequence,
+// CRC and ack logic as otachunk() in ESPRevK.cpp, and losing loss% of chunks and acks (default 5), to check the sender
+// (Over a real broker, QoS 0 on TCP only loses messages if a connection drops, the device then times out after 60s)
+//
+// Protocol (see ESPRevK.cpp) :-
+// Sender sends command otamqtt with size, SHA-256 (hex), and "delta" if a delta
+// Device replies info/otaack with 0, window, and max chunk size
+// Sender sends command otachunk with sequence (from 0) and CRC32 of data (32 bits little endian), then up to chunk size bytes
+// Device replies info/otaack with next sequence wanted, after each window/2 chunks, and once on a gap or bad CRC
+// The sender keeps up to window chunks unacknowledged, and goes back to the sequence in an otaack for a gap
+// Device state is "0 OTA Ready" when the image is checked, or "0 OTA Error reason"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+typedef uint8_t byte;
+typedef std::vector < byte > bytes;
+
+#define	ACKWAIT		5000    // ms with no ack before sending from last ack again
+#define	ACKTRIES	12      // Times to do that before giving up
+#define	STARTWAIT	10000   // ms for device to answer otamqtt
+#define	READYWAIT	30000   // ms for device to check image after last chunk
+
+static uint32_t
+crc32 (const byte * p, size_t len)
+{                               // Same as settings_crc() in ESPRevK.cpp
+   uint32_t crc = 0xFFFFFFFF;
+   while (len--)
+   {
+      crc ^= *p++;
+      for (int b = 0; b < 8; b++)
+         crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+   }
+   return ~crc;
+}
+
+static void
+sha256 (const byte * msg, size_t len, byte out[32])
+{                               // FIPS 180-4
+   static const uint32_t k[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+      0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+      0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+      0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+   };
+   uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+   bytes m (msg, msg + len);
+   m.push_back (0x80);
+   while (m.size () % 64 != 56)
+      m.push_back (0);
+   for (int i = 7; i >= 0; i--)
+      m.push_back ((uint64_t) len * 8 >> (i * 8));
+#define	ror(x,n)	(((x)>>(n))|((x)<<(32-(n))))
+   for (size_t o = 0; o < m.size (); o += 64)
+   {
+      uint32_t w[64],
+        v[8];
+      for (int i = 0; i < 16; i++)
+         w[i] = ((uint32_t) m[o + i * 4] << 24) | (m[o + i * 4 + 1] << 16) | (m[o + i * 4 + 2] << 8) | m[o + i * 4 + 3];
+      for (int i = 16; i < 64; i++)
+         w[i] = w[i - 16] + (ror (w[i - 15], 7) ^ ror (w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 7]
+            + (ror (w[i - 2], 17) ^ ror (w[i - 2], 19) ^ (w[i - 2] >> 10));
+      memcpy (v, h, sizeof (v));
+      for (int i = 0; i < 64; i++)
+      {
+         uint32_t t1 = v[7] + (ror (v[4], 6) ^ ror (v[4], 11) ^ ror (v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i],
+            t2 = (ror (v[0], 2) ^ ror (v[0], 13) ^ ror (v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+         memmove (v + 1, v, sizeof (uint32_t) * 7);
+         v[4] += t1;
+         v[0] = t1 + t2;
+      }
+      for (int i = 0; i < 8; i++)
+         h[i] += v[i];
+   }
+#undef ror
+   for (int i = 0; i < 32; i++)
+      out[i] = h[i / 4] >> ((3 - i % 4) * 8);
+}
+
+static unsigned long
+now ()
+{                               // ms
+   struct timeval tv;
+   gettimeofday (&tv, NULL);
+   return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+typedef struct msg_s msg_t;
+struct msg_s
+{                               // Received publish
+   std::string topic;
+   bytes payload;
+   bool retain;
+};
+
+// MQTT 3.1.1, just what is needed: CONNECT, SUBSCRIBE, PUBLISH QoS 0, PINGREQ
+static int sock = -1;
+static unsigned long lastsent = 0;
+
+static bool
+mqttsend (byte type, const bytes & body)
+{
+   bytes b;
+   b.push_back (type);
+   size_t l = body.size ();
+   do
+   {
+      byte c = l & 0x7F;
+      l >>= 7;
+      b.push_back (c | (l ? 0x80 : 0));
+   }
+   while (l);
+   b.insert (b.end (), body.begin (), body.end ());
+   size_t o = 0;
+   while (o < b.size ())
+   {
+      ssize_t n = write (sock, &b[o], b.size () - o);
+      if (n <= 0)
+         return false;
+      o += n;
+   }
+   lastsent = now ();
+   return true;
+}
+
+static void
+putstr (bytes & b, const std::string & s)
+{
+   b.push_back (s.size () >> 8);
+   b.push_back (s.size ());
+   b.insert (b.end (), s.begin (), s.end ());
+}
+
+static bool
+readn (byte * p, size_t l)
+{
+   while (l)
+   {
+      ssize_t n = read (sock, p, l);
+      if (n <= 0)
+         return false;
+      p += n;
+      l -= n;
+   }
+   return true;
+}
+
+static int
+mqttread (byte * type, bytes & body, int wait)
+{                               // Read a packet, 1 if got one, 0 if none in wait ms, -1 if error
+   struct pollfd p = { sock, POLLIN, 0 };
+   int r = poll (&p, 1, wait);
+   if (r <= 0)
+      return r;
+   if (!readn (type, 1))
+      return -1;
+   size_t l = 0;
+   int shift = 0;
+   byte c;
+   do
+   {
+      if (!readn (&c, 1) || shift > 21)
+         return -1;
+      l |= (size_t) (c & 0x7F) << shift;
+      shift += 7;
+   }
+   while (c & 0x80);
+   body.resize (l);
+   if (l && !readn (&body[0], l))
+      return -1;
+   return 1;
+}
+
+static const char *
+mqttconnect (const char *host, const char *port, const char *user, const char *pass)
+{                               // Connect, returns error or NULL
+   struct addrinfo hints = { }, *res, *a;
+   hints.ai_socktype = SOCK_STREAM;
+   if (getaddrinfo (host, port, &hints, &res))
+      return "Cannot resolve broker";
+   for (a = res; a; a = a->ai_next)
+   {
+      sock = socket (a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (sock >= 0 && !connect (sock, a->ai_addr, a->ai_addrlen))
+         break;
+      if (sock >= 0)
+         close (sock);
+      sock = -1;
+   }
+   freeaddrinfo (res);
+   if (sock < 0)
+      return "Cannot connect to broker";
+   bytes b;
+   putstr (b, "MQTT");
+   b.push_back (4);             // 3.1.1
+   b.push_back (0x02 | (user ? 0x80 : 0) | (user && pass ? 0x40 : 0));  // Clean session
+   b.push_back (0);
+   b.push_back (60);            // Keep alive
+   char id[32];
+   snprintf (id, sizeof (id), "otamqtt-%d", (int) getpid ());
+   putstr (b, id);
+   if (user)
+      putstr (b, user);
+   if (user && pass)
+      putstr (b, pass);
+   byte type;
+   if (!mqttsend (0x10, b) || mqttread (&type, b, 5000) != 1 || type != 0x20 || b.size () < 2)
+      return "No CONNACK";
+   if (b[1])
+      return "Broker refused connection";
+   return NULL;
+}
+
+static bool
+mqttsubscribe (const std::string & topic)
+{
+   static uint16_t id = 0;
+   bytes b;
+   id++;
+   b.push_back (id >> 8);
+   b.push_back (id);
+   putstr (b, topic);
+   b.push_back (0);             // QoS 0
+   return mqttsend (0x82, b);
+}
+
+static bool
+mqttpublish (const std::string & topic, const bytes & payload)
+{
+   bytes b;
+   putstr (b, topic);
+   b.insert (b.end (), payload.begin (), payload.end ());
+   return mqttsend (0x30, b);
+}
+
+static int
+mqttpoll (msg_t & m, int wait)
+{                               // Wait for a publish, 1 if got one, 0 if not in wait ms, -1 if error
+   unsigned long end = now () + wait;
+   while (1)
+   {
+      if (now () - lastsent > 30000 && !mqttsend (0xC0, bytes ()))
+         return -1;             // PINGREQ
+      int left = (int) (end - now ());
+      if (left < 0)
+         left = 0;
+      byte type;
+      bytes b;
+      int r = mqttread (&type, b, left);
+      if (r <= 0)
+         return r;
+      if ((type & 0xF0) != 0x30 || b.size () < 2)
+         continue;              // SUBACK, PINGRESP, etc
+      size_t tl = (b[0] << 8) | b[1],
+         o = 2 + tl;
+      if (o > b.size ())
+         return -1;
+      if (type & 0x06)
+         o += 2;                // Packet ID (QoS 1/2, not expected)
+      m.topic.assign ((char *) &b[2], tl);
+      m.payload.assign (b.begin () + (o < b.size ()? o : b.size ()), b.end ());
+      m.retain = (type & 1);
+      return 1;
+   }
+}
+
+// Stand-in broker and device, so the sender can be checked with no device
+static int loss = 5;            // % of messages lost
+static std::deque < msg_t > standq;    // Messages to sender
+static std::string standtopic;  // Prefix for device topics
+static bytes standimg;          // Received
+static byte standsha[32];
+static uint32_t standsize = 0,
+   standseq = 0,
+   standnack = ~0;
+static bool standrun = false;
+static unsigned long standsent = 0,
+   standlost = 0,
+   standbad = 0,
+   standdup = 0;
+#define	STANDWINDOW	4       // As OTAMQTTWINDOW
+#define	STANDCHUNK	1024    // As OTAMQTTCHUNK
+
+static void
+standpub (const std::string & suffix, const std::string & text, bool lose = true)
+{
+   if (lose && rand () % 100 < loss)
+   {
+      standlost++;
+      return;
+   }
+   msg_t m;
+   m.topic = suffix;
+   m.payload.assign (text.begin (), text.end ());
+   m.retain = false;
+   standq.push_back (m);
+}
+
+static void
+standmsg (const std::string & topic, bytes p)
+{                               // Device end, as command_otamqtt() and otachunk()
+   char temp[120];
+   standsent++;
+   if (topic == "command/" + standtopic + "/otamqtt")
+   {
+      snprintf (temp, sizeof (temp), "%.*s", (int) p.size (), (char *) p.data ());
+      char *e;
+      standsize = strtoul (temp, &e, 10);
+      for (int i = 0; i < 32; i++)
+         sscanf (e + 1 + i * 2, "%2hhx", &standsha[i]);
+      standimg.clear ();
+      standseq = 0;
+      standnack = ~0;
+      standrun = true;
+      snprintf (temp, sizeof (temp), "0 %u %u", STANDWINDOW, STANDCHUNK);
+      standpub ("info/" + standtopic + "/otaack", temp, false);        // Not lost, as not sent again by device
+      return;
+   }
+   if (topic != "command/" + standtopic + "/otachunk" || !standrun || p.size () < 8)
+      return;
+   if (rand () % 100 < loss)
+   {
+      standlost++;
+      return;
+   }
+   if (rand () % 200 < loss)
+   {
+      p[8 + rand () % (p.size () - 8)] ^= 1;    // Corrupt
+      standbad++;
+   }
+   uint32_t seq = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24),
+      crc = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t) p[7] << 24);
+   size_t len = p.size () - 8;
+   if (seq == standseq && len && len <= standsize - standimg.size () && crc32 (&p[8], len) == crc)
+   {
+      standimg.insert (standimg.end (), p.begin () + 8, p.end ());
+      standseq++;
+      if (standimg.size () == standsize)
+      {
+         byte h[32];
+         sha256 (standimg.data (), standimg.size (), h);
+         standrun = false;
+         snprintf (temp, sizeof (temp), "%u", standseq);
+         standpub ("info/" + standtopic + "/otaack", temp);
+         msg_t m;               // State is retained, so not lost
+         m.topic = "state/" + standtopic;
+         m.payload.clear ();
+         std::string s = (memcmp (h, standsha, 32) ? "0 OTA Error Bad SHA256" : "0 OTA Ready");
+         m.payload.assign (s.begin (), s.end ());
+         m.retain = false;
+         standq.push_back (m);
+         return;
+      }
+      if (standseq % (STANDWINDOW / 2))
+         return;
+   } else if (seq >= standseq)
+   {
+      if (standnack == standseq)
+         return;
+      standnack = standseq;
+   } else
+      standdup++;
+   snprintf (temp, sizeof (temp), "%u", standseq);
+   standpub ("info/" + standtopic + "/otaack", temp);
+}
+
+static bool stand = false;
+
+static bool
+publish (const std::string & topic, const bytes & payload)
+{
+   if (stand)
+   {
+      standmsg (topic, payload);
+      return true;
+   }
+   return mqttpublish (topic, payload);
+}
+
+static int
+poll (msg_t & m, int wait)
+{
+   if (stand)
+   {
+      if (standq.empty ())
+         return 0;              // Would have waited
+      m = standq.front ();
+      standq.pop_front ();
+      return 1;
+   }
+   return mqttpoll (m, wait);
+}
+
+int
+main (int argc, const char *argv[])
+{
+   const char *host = "localhost",
+      *port = "1883",
+      *user = NULL,
+      *pass = NULL;
+   int a = 1;
+   for (; a + 1 < argc && argv[a][0] == '-' && argv[a][1]; a += 2)
+      switch (argv[a][1])
+      {
+      case 'h':
+         host = argv[a + 1];
+         break;
+      case 'p':
+         port = argv[a + 1];
+         break;
+      case 'u':
+         user = argv[a + 1];
+         break;
+      case 'P':
+         pass = argv[a + 1];
+         break;
+      case 'l':
+         loss = atoi (argv[a + 1]);
+         break;
+      default:
+         a = argc;
+      }
+   if (argc - a != 3)
+   {
+      fprintf (stderr, "Usage: %s [-h broker] [-p port] [-u user] [-P pass] [-l loss%%] app hostname file\n", argv[0]);
+      return 1;
+   }
+   std::string dev = std::string (argv[a]) + "/" + argv[a + 1];
+   bytes img;
+   {
+      FILE *f = fopen (argv[a + 2], "rb");
+      if (!f)
+      {
+         perror (argv[a + 2]);
+         return 1;
+      }
+      byte buf[4096];
+      size_t l;
+      while ((l = fread (buf, 1, sizeof (buf), f)) > 0)
+         img.insert (img.end (), buf, buf + l);
+      fclose (f);
+   }
+   if (img.empty ())
+   {
+      fprintf (stderr, "Empty file\n");
+      return 1;
+   }
+   bool delta = (img.size () >= 4 && !memcmp (img.data (), "RDP1", 4));
+   if (!strcmp (host, "-"))
+   {
+      stand = true;
+      standtopic = dev;
+      srand (now ());
+   } else
+   {
+      const char *e = mqttconnect (host, port, user, pass);
+      if (!e && (!mqttsubscribe ("info/" + dev + "/otaack") || !mqttsubscribe ("state/" + dev)))
+         e = "Cannot subscribe";
+      if (e)
+      {
+         fprintf (stderr, "%s\n", e);
+         return 1;
+      }
+   }
+   {                            // Start
+      byte h[32];
+      sha256 (img.data (), img.size (), h);
+      char cmd[120];
+      int l = snprintf (cmd, sizeof (cmd), "%u ", (unsigned) img.size ());
+      for (int i = 0; i < 32; i++)
+         l += snprintf (cmd + l, sizeof (cmd) - l, "%02x", h[i]);
+      if (delta)
+         l += snprintf (cmd + l, sizeof (cmd) - l, " delta");
+      publish ("command/" + dev + "/otamqtt", bytes (cmd, cmd + l));
+   }
+   unsigned int window = 0,
+      chunk = 0,
+      tries = 0;
+   uint32_t next = 0,
+      acked = 0,
+      rewound = ~0,             // Last ack we went back to
+      chunks = 0;
+   unsigned long start = now (),
+      last = start;
+   const char *fail = NULL;
+   while (!fail)
+   {
+      if (window)
+         while (next < chunks && next < acked + window)
+         {                      // Send
+            uint32_t o = next * chunk,
+               n = (img.size () - o < chunk ? img.size () - o : chunk),
+               crc = crc32 (&img[o], n);
+            bytes m;
+            for (int i = 0; i < 4; i++)
+               m.push_back (next >> (i * 8));
+            for (int i = 0; i < 4; i++)
+               m.push_back (crc >> (i * 8));
+            m.insert (m.end (), img.begin () + o, img.begin () + o + n);
+            if (!publish ("command/" + dev + "/otachunk", m))
+               fail = "Send failed";
+            next++;
+         }
+      msg_t m;
+      int wait = (!window ? STARTWAIT : acked < chunks ? ACKWAIT : READYWAIT);
+      int r = poll (m, (int) (last + wait - now ()) > 0 ? (int) (last + wait - now ()) : 0);
+      if (r < 0)
+         fail = "Broker connection lost";
+      if (!r)
+      {                         // Timeout
+         if (!window)
+            fail = "No reply to otamqtt (not connected, or busy with another OTA?)";
+         else if (acked >= chunks)
+            fail = "No OTA Ready from device";
+         else if (++tries > ACKTRIES)
+            fail = "Device stopped acknowledging";
+         else
+            next = acked;       // Send again from last ack
+         last = now ();
+         continue;
+      }
+      std::string p ((char *) m.payload.data (), m.payload.size ());
+      if (m.retain)
+         continue;              // Old state
+      if (m.topic == "state/" + dev)
+      {
+         if (!p.compare (0, 7, "0 OTA E"))
+         {
+            fprintf (stderr, "%s\n", p.c_str () + 2);
+            return 1;
+         }
+         if (p == "0 OTA Ready")
+            break;
+         continue;
+      }
+      if (m.topic != "info/" + dev + "/otaack")
+         continue;
+      unsigned int s = 0,
+         w = 0,
+         c = 0;
+      int n = sscanf (p.c_str (), "%u %u %u", &s, &w, &c);
+      if (n == 3 && !s)
+      {                         // Start
+         if (window)
+            continue;
+         window = w;
+         chunk = c;
+         if (!window || !chunk)
+            fail = "Bad otaack";
+         chunks = (img.size () + chunk - 1) / chunk;
+         printf ("Sending %u bytes%s, %u chunks of %u, window %u\n", (unsigned) img.size (), delta ? " (delta)" : "",
+                 chunks, chunk, window);
+         last = now ();
+         continue;
+      }
+      if (n != 1 || !window)
+         continue;
+      last = now ();
+      tries = 0;
+      // Acks are normally every window/2 chunks, so any other value, or the same again, is the device asking for a gap to be filled
+      // Only go back once for each, as the chunks already sent after it each get an ack too (a second loss is left to the timeout)
+      if (s < next && s != rewound && (s == acked || s % (window / 2 ? : 1)))
+         next = rewound = s;
+      if (s > acked)
+         acked = s;
+      if (s > next)
+         next = s;
+      if (acked % 64 == 0 || acked == chunks)
+      {
+         printf ("\r%u/%u", acked, chunks);
+         fflush (stdout);
+      }
+   }
+   if (fail)
+   {
+      fprintf (stderr, "\n%s\n", fail);
+      return 1;
+   }
+   printf ("\nOTA Ready, %lums\n", now () - start);
+   if (stand)
+      printf ("Stand-in: %lu messages, %lu lost, %lu corrupt, %lu duplicate, image %s\n", standsent, standlost, standbad,
+              standdup, standimg == img ? "matches" : "DIFFERS");
+   if (sock >= 0)
+   {
+      mqttsend (0xE0, bytes ());       // DISCONNECT
+      close (sock);
+   }
+   return 0;
+}
@@ -0,0 +1,279 @@
+#!/usr/bin/env python3
+# Stand-in OTA HTTPS server for ESPRevK upgrade, that cuts the connection mid-image to check Range resume
+# Usage: otaresume.py [-p port] [-m mode] [-c cut] [--cert pem --key pem] [--self] image.bin
+# Serves image.bin and image.bin.sha256 (sha256sum format, plain image only, so no .gz or delta is asked for)
+# Set otahost to this host, and otasha1 to the fingerprint it prints (self signed cert, made with openssl if not given),
+# then send upgrade, the device always uses port 443 (so use -p 443, or forward it), the URL path is /app.ino.board.bin,
+# so name image.bin that, or it is served for any .bin path anyway
+# The first image GET is cut after cut bytes (default a third), then the resumed GET is checked and answered per mode :-
+# resume   206 with right Content-Range, the device should finish, and show "0 OTA Ready" (SHA-256 checked)
+# norange  200 with whole image (server ignores Range), the device should skip what it has, and finish
+# behind   206 from 1000 bytes before the Range asked, the device should skip those, and finish
+# ahead    206 from 1000 bytes after the Range asked, the device should give up with "Changed"
+# changed  206 with a different total size in Content-Range, the device should give up with "Changed"
+# grown    200 with a different size (new image), the device should give up with "Changed"
+# Check is that the resumed Range is bytes=<bytes sent>-, and that after "Changed" the image is not asked for again
+# With --self there is no device, a client in this program does the same steps as otastep() in ESPRevK.cpp, for each mode
+
+import argparse
+import hashlib
+import http.server
+import os
+import re
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+EXPECT = {
+    "resume": "Ready",
+    "norange": "Ready",
+    "behind": "Ready",
+    "ahead": "Changed",
+    "changed": "Changed",
+    "grown": "Changed",
+}
+CHANGEDWAIT = 15  # s with no image request after "Changed" to pass
+
+
+class State:
+    def __init__(self, image, mode, cut):
+        self.image = image
+        self.mode = mode
+        self.cut = cut
+        self.gets = 0  # Image GETs
+        self.sent = 0  # Bytes sent on first GET
+        self.result = None  # PASS/FAIL text
+        self.lastget = 0
+        self.lock = threading.Lock()
+
+    def report(self, ok, text):
+        with self.lock:
+            if self.result and self.result.startswith("FAIL"):
+                return  # First failure stands
+            self.result = ("PASS " if ok else "FAIL ") + text
+            print(self.result, flush=True)
+
+
+def handler(state):
+    class Handler(http.server.BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def log_message(self, fmt, *args):
+            print("%s %s" % (self.address_string(), fmt % args), flush=True)
+
+        def send(self, code, body, headers=()):
+            self.send_response(code)
+            for k, v in headers:
+                self.send_header(k, v)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def do_GET(self):
+            try:
+                self.get()
+            except (OSError, ssl.SSLError):
+                self.close_connection = True  # Client gave up, e.g. on "Changed"
+
+        def get(self):
+            path = self.path.split("?")[0]
+            img = state.image
+            if path.endswith(".bin.sha256"):
+                name = os.path.basename(path[:-7])
+                self.send(200, ("%s  %s\n" % (hashlib.sha256(img).hexdigest(), name)).encode())
+                return
+            if not path.endswith(".bin"):
+                self.send(404, b"")
+                return
+            state.gets += 1
+            state.lastget = time.time()
+            rng = self.headers.get("Range")
+            if state.gets == 1:
+                # First, send part and cut
+                if rng:
+                    state.report(False, "first request has Range %s" % rng)
+                n = min(state.cut, len(img) - 1)
+                self.send_response(200)
+                self.send_header("Content-Length", str(len(img)))
+                self.end_headers()
+                self.wfile.write(img[:n])
+                self.wfile.flush()
+                state.sent = n
+                print("Cut after %d/%d bytes" % (n, len(img)), flush=True)
+                self.close_connection = True
+                try:
+                    self.connection.shutdown(socket.SHUT_RDWR)
+                except OSError:
+                    pass
+                return
+            if state.gets == 2:
+                want = "bytes=%d-" % state.sent
+                if rng != want:
+                    state.report(False, "resumed with Range %s, expected %s" % (rng, want))
+                else:
+                    print("Resumed with Range %s" % rng, flush=True)
+            elif EXPECT[state.mode] == "Changed":
+                state.report(False, "image asked for again after Changed (%s)" % state.mode)
+            frm = state.sent
+            total = len(img)
+            mode = state.mode if state.gets == 2 else "resume"
+            if mode == "norange":
+                self.send(200, img)
+                state.report(True, "norange, whole image sent again")
+                return
+            if mode == "grown":
+                self.send(200, img + b"\xff" * 4096)
+                return
+            if mode == "behind":
+                frm = max(0, frm - 1000)
+            elif mode == "ahead":
+                frm = min(total - 1, frm + 1000)
+            elif mode == "changed":
+                total += 4096
+            self.send(206, img[frm:], (("Content-Range", "bytes %d-%d/%d" % (frm, len(img) - 1, total)),))
+            if EXPECT[state.mode] == "Ready":
+                state.report(True, "%s, whole image sent after resume" % state.mode)
+
+    return Handler
+
+
+def makecert(directory):
+    cert = os.path.join(directory, "cert.pem")
+    key = os.path.join(directory, "key.pem")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "30", "-subj", "/CN=ota",
+                    "-keyout", key, "-out", cert], check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+def serve(state, port, cert, key):
+    httpd = http.server.ThreadingHTTPServer(("", port), handler(state))
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.load_cert_chain(cert, key)
+    httpd.socket = ctx.wrap_socket(httpd.socket, server_side=True)
+    threading.Thread(target=httpd.serve_forever, daemon=True).start()
+    return httpd
+
+
+def otaclient(host, port, path):
+    """Same steps as otastep() in ESPRevK.cpp: manifest, then connect/resume with Content-Range check, and SHA-256"""
+    ctx = ssl._create_unverified_context()  # The device checks otasha1 fingerprint
+
+    def get(url, frm):
+        s = ctx.wrap_socket(socket.create_connection((host, port)), server_hostname=host)
+        req = "GET %s HTTP/1.1\r\nHost: %s\r\n" % (url, host)
+        if frm:
+            req += "Range: bytes=%d-\r\n" % frm
+        s.sendall((req + "\r\n").encode())
+        f = s.makefile("rb")
+        code = int(f.readline().split()[1])
+        headers = {}
+        while True:
+            line = f.readline().strip()
+            if not line:
+                break
+            k, v = line.decode().split(":", 1)
+            headers[k.strip().lower()] = v.strip()
+        return code, headers, f, s
+
+    code, headers, f, s = get(path + ".sha256", 0)
+    sha = None
+    if code == 200:
+        m = f.read(int(headers["content-length"])).decode()
+        for line in m.splitlines():
+            h, _, name = line.partition(" ")
+            if name.strip(" *") == os.path.basename(path):
+                sha = h
+    s.close()
+    done = 0
+    size = 0
+    data = b""
+    tries = 0
+    while True:
+        tries += 1
+        if tries > 5:
+            return "Too many tries"
+        code, headers, f, s = get(path, done)
+        skip = 0
+        if not done and code == 200:
+            size = int(headers["content-length"])
+        elif done and code == 200:
+            if int(headers["content-length"]) != size:  # Server ignored range, so discard what we have
+                return "Changed"
+            skip = done
+        elif done and code == 206:
+            m = re.match(r"\D*(\d+)-\d+/(\d+)", headers.get("content-range", ""))
+            if not m or int(m.group(2)) != size or int(m.group(1)) > done:
+                return "Changed"
+            skip = done - int(m.group(1))
+        else:
+            s.close()
+            continue
+        left = int(headers["content-length"])
+        while left:
+            b = f.read(min(512, left))
+            if not b:
+                break  # Dropped, resume
+            left -= len(b)
+            if skip:
+                n = min(skip, len(b))
+                skip -= n
+                b = b[n:]
+            data += b[:size - done]
+            done = len(data)
+        s.close()
+        if done == size:
+            if sha and hashlib.sha256(data).hexdigest() != sha:
+                return "SHA-256 mismatch"
+            return "Ready"
+
+
+def main():
+    p = argparse.ArgumentParser(description="Stand-in OTA HTTPS server that cuts the image to check Range resume")
+    p.add_argument("-p", "--port", type=int, default=443)
+    p.add_argument("-m", "--mode", choices=sorted(EXPECT), default="resume")
+    p.add_argument("-c", "--cut", type=int, default=0, help="bytes before cut (default a third of image)")
+    p.add_argument("--cert")
+    p.add_argument("--key")
+    p.add_argument("--self", action="store_true", help="run all modes against a client in this program")
+    p.add_argument("image")
+    a = p.parse_args()
+    image = open(a.image, "rb").read()
+    cut = a.cut or len(image) // 3
+    tmp = tempfile.TemporaryDirectory()
+    cert, key = (a.cert, a.key) if a.cert else makecert(tmp.name)
+    der = ssl.PEM_cert_to_DER_cert(open(cert).read())
+    fp = hashlib.sha1(der).hexdigest()
+    if a.self:
+        fails = 0
+        port = a.port if a.port != 443 else 0
+        for mode in sorted(EXPECT):
+            state = State(image, mode, cut)
+            httpd = serve(state, port, cert, key)
+            got = otaclient("localhost", httpd.server_address[1], "/" + os.path.basename(a.image))
+            httpd.shutdown()
+            httpd.server_close()
+            ok = got == EXPECT[mode] and not (state.result or "").startswith("FAIL")
+            fails += not ok
+            print("%-8s %-8s %s" % (mode, got, "PASS" if ok else "FAIL (expected %s)" % EXPECT[mode]), flush=True)
+        return 1 if fails else 0
+    state = State(image, a.mode, cut)
+    serve(state, a.port, cert, key)
+    print("Serving %s (%d bytes) on port %d, mode %s, cut at %d" % (a.image, len(image), a.port, a.mode, cut))
+    print("Set otasha1 to %s, then send upgrade, device should end with %s" % (fp, EXPECT[a.mode]), flush=True)
+    try:
+        while True:
+            time.sleep(1)
+            if EXPECT[a.mode] == "Changed" and state.gets == 2 and time.time() - state.lastget > CHANGEDWAIT:
+                state.report(True, "%s, not asked for again after Changed" % a.mode)
+                state.gets = 3
+    except KeyboardInterrupt:
+        pass
+    return 0 if state.result and state.result.startswith("PASS") else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,102 @@
+// Host count of flash sector erases for ESPRevK settings changes, append only log against the old rewrite of all settings
+// Build: g++ -O2 -o settingsbench settingsbench.cpp
+// Usage: settingsbench [changes [settings [maxlen [slots]]]]
+// There are settings tags (default 30, about what the library and a small app have) with random values up to maxlen
+// (default 32) bytes, each change sets one of them to a new random value and is saved, as after the 1s settings delay
+// Old scheme (EEPROM library, as before the log) erases the sector and writes all 1024 bytes of EEPROM on every save
+// Log scheme appends one record per change, and only erases to compact when the sector is full, using record and header
+// sizes the same as ESPRevK.cpp, with slots (default 1) taking the erases in turn, so flash wear is spread over them
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define	SPI_FLASH_SEC_SIZE	4096
+#define	MAXEEPROM	1024    // Old EEPROM size
+#define settingspad(l)	(((l)+3)&~3)    // Same as ESPRevK.cpp
+#define settingsrec(t,l)	settingspad(6+(t)+(l))
+#define settingshead(a)	settingspad(13+(a))
+#define	APPNAMELEN	10      // e.g. MyFirstApp
+
+static uint32_t r = 1;
+
+static uint32_t
+rnd ()
+{                               // xorshift32
+   r ^= r << 13;
+   r ^= r >> 17;
+   r ^= r << 5;
+   return r;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   int changes = (argc > 1 ? atoi (argv[1]) : 1000);
+   int settings = (argc > 2 ? atoi (argv[2]) : 30);
+   int maxlen = (argc > 3 ? atoi (argv[3]) : 32);
+   int slots = (argc > 4 ? atoi (argv[4]) : 1);
+   if (settings < 1 || maxlen < 1 || maxlen > 255 || slots < 1 || slots > 2)
+   {
+      fprintf (stderr, "Bad args\n");
+      return 1;
+   }
+   int *taglen = (int *) malloc (settings * sizeof (int));
+   int *len = (int *) malloc (settings * sizeof (int));
+   unsigned int all = settingshead (APPNAMELEN),       // Log size if compacted
+      old = 7 + APPNAMELEN;     // Old format, sig, app name, records, end
+   int i;
+   for (i = 0; i < settings; i++)
+   {
+      taglen[i] = 4 + rnd () % 9;
+      len[i] = 1 + rnd () % maxlen;
+      all += settingsrec (taglen[i], len[i]);
+      old += 2 + taglen[i] + len[i];
+   }
+   if (all > SPI_FLASH_SEC_SIZE || old >= MAXEEPROM)
+      printf ("Note: settings do not fit old EEPROM (%u/%u bytes)\n", old, MAXEEPROM);
+   // Log
+   unsigned int tail = all;     // Starts compacted
+   long logerase[2] = { 1, 0 },
+      logbytes = all,
+      compacts = 0;
+   int slot = 0;
+   for (int c = 0; c < changes; c++)
+   {
+      i = rnd () % settings;
+      all -= settingsrec (taglen[i], len[i]);
+      len[i] = 1 + rnd () % maxlen;
+      all += settingsrec (taglen[i], len[i]);
+      unsigned int rec = settingsrec (taglen[i], len[i]);
+      if (tail + rec > SPI_FLASH_SEC_SIZE)
+      {                         // Full, compact, all current settings written to other slot (or in place)
+         if (all > SPI_FLASH_SEC_SIZE)
+         {
+            fprintf (stderr, "Settings too big\n");
+            return 1;
+         }
+         slot = (slots > 1 ? 1 - slot : 0);
+         logerase[slot]++;
+         logbytes += all;
+         compacts++;
+         tail = all;
+      } else
+      {
+         logbytes += rec;
+         tail += rec;
+      }
+   }
+   // Old, every save rewrites the sector
+   long olderase = 1 + changes,
+      oldbytes = (long) MAXEEPROM * (1 + changes);
+   printf ("%d changes, %d settings up to %d bytes, %d slot%s\n", changes, settings, maxlen, slots, slots > 1 ? "s" : "");
+   printf ("Old rewrite: %6ld erases, %8ld bytes written, %6ld erases on busiest sector\n", olderase, oldbytes, olderase);
+   printf ("Append log:  %6ld erases, %8ld bytes written, %6ld erases on busiest sector (%ld compactions)\n",
+           logerase[0] + logerase[1], logbytes, logerase[0] > logerase[1] ? logerase[0] : logerase[1], compacts);
+   printf ("Erases per change: old %.3f, log %.3f, %.0f times fewer\n", (double) olderase / (1 + changes),
+           (double) (logerase[0] + logerase[1]) / (1 + changes), (double) olderase / (logerase[0] + logerase[1]));
+   free (taglen);
+   free (len);
+   return 0;
+}
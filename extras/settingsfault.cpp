@@ -0,0 +1,530 @@
+// Host test of the ESPRevK settings log against power cuts, cutting power at every flash write and erase in turn
+// Build: g++ -O2 -o settingsfault settingsfault.cpp
+// Usage: settingsfault [slots [changes [seed]]]
+// The settings log code is the same as ESPRevK.cpp (settings_record, settings_pick, settings_compact, settings_save,
+// loadsettings), on two flash sectors in memory that behave like NOR flash, writes only clear bits, erase sets all bits
+// A run makes random changes (set, replace, delete, 1 to 3 per save) until several compactions have happened
+// Each flash write and erase is a step, the run is repeated with power cut at each step in turn, the write or erase at
+// that step is torn (only part of it done), then loadsettings is run as on boot, and one more change is saved and loaded
+// After the cut, loadsettings has to give the last set saved, plus any of the records of the save that was cut, in order,
+// as each record is checked on its own, and the one after the cut has to save and load cleanly
+// With 2 slots there should be no failures, with 1 slot (the default layout) a cut while compacting in place loses settings
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define	SPI_FLASH_SEC_SIZE	4096
+static int slots = 2;           // SETTINGSSLOTS
+static byte flash[2][SPI_FLASH_SEC_SIZE];       // Sector for slot n is flash[n]
+
+// Power cut
+static long step = 0;           // Flash writes and erases so far
+static long cutat = 0;          // Step at which power is cut, 0 for none
+static boolean dead = false;    // Power has been cut
+static uint32_t r = 1;
+
+static uint32_t
+rnd ()
+{                               // xorshift32
+   r ^= r << 13;
+   r ^= r >> 17;
+   r ^= r << 5;
+   return r;
+}
+
+static boolean
+flashEraseSector (int slot)
+{
+   if (dead)
+      return false;
+   if (++step == cutat)
+   {                            // Torn erase, part of sector erased
+      memset (flash[slot], 0xFF, rnd () % SPI_FLASH_SEC_SIZE);
+      dead = true;
+      return false;
+   }
+   memset (flash[slot], 0xFF, SPI_FLASH_SEC_SIZE);
+   return true;
+}
+
+static boolean
+flashWrite (int slot, unsigned int addr, const uint32_t * data, unsigned int len)
+{                               // NOR flash, bits can only be cleared
+   if (dead)
+      return false;
+   const byte *d = (const byte *) data;
+   if (++step == cutat)
+   {                            // Torn write, some of it written
+      len = rnd () % len;
+      dead = true;
+   }
+   for (unsigned int i = 0; i < len; i++)
+      flash[slot][addr + i] &= d[i];
+   return !dead;
+}
+
+static boolean
+flashRead (int slot, unsigned int addr, uint32_t * data, unsigned int len)
+{
+   if (dead)
+      return false;
+   memcpy (data, flash[slot] + addr, len);
+   return true;
+}
+
+static uint32_t
+revk_hash (const char *t, uint32_t h = 2166136261U)
+{                               // Same as ESPRevK.h
+   return *t ? revk_hash (t + 1, (h ^ (uint8_t) (*t >= 'A' && *t <= 'Z' ? *t + 'a' - 'A' : *t)) * 16777619U) : h;
+}
+
+// Settings table, as ESPRevK.cpp, values malloc'd as packing does not matter here
+typedef struct setting_s setting_t;
+struct setting_s
+{
+   uint32_t hash;
+   char *tag;
+   byte *value;
+   byte len;
+   boolean dirty;
+};
+#define	SETTINGSTAG	32      // Max tag len
+#define	SETTINGSREC	settingspad(6+SETTINGSTAG+255)   // Max record len (padded)
+#define	SETTINGSHEAD	settingspad(13+255)     // Max header len (padded)
+#define settingspad(l)	(((l)+3)&~3)
+#define settingsrec(t,l)	settingspad(6+(t)+(l))
+#define settingshead(a)	settingspad(13+(a))
+const char settingssig[] = "RevS";
+static const char appname[] = "FaultTest";
+static const int appnamelen = sizeof (appname) - 1;
+static setting_t *set = NULL;
+static unsigned int setcount = 0;
+static unsigned int setmax = 0;
+static unsigned int setlen = settingshead (0);
+static unsigned int settingstail = 0;
+static unsigned int settingserase = 0;
+static byte settingsslot = 0;
+static uint32_t settingsseq = 0;
+static long settingsupdate = 0;
+
+static void
+settings_clear ()
+{                               // As on boot
+   for (unsigned int i = 0; i < setcount; i++)
+   {
+      free (set[i].tag);
+      free (set[i].value);
+   }
+   setcount = 0;
+   setlen = settingshead (0);
+   settingstail = 0;
+   settingsslot = 0;
+   settingsseq = 0;
+   settingsupdate = 0;
+}
+
+static setting_t *
+setting_find (const char *tag, uint32_t hash, unsigned int *pos)
+{                               // Same as ESPRevK.cpp
+   unsigned int lo = 0,
+      hi = setcount;
+   while (lo < hi)
+   {
+      unsigned int m = (lo + hi) / 2;
+      if (set[m].hash < hash)
+         lo = m + 1;
+      else
+         hi = m;
+   }
+   *pos = lo;
+   for (; lo < setcount && set[lo].hash == hash; lo++)
+      if (!strcasecmp (tag, set[lo].tag))
+      {
+         *pos = lo;
+         return set + lo;
+      }
+   return NULL;
+}
+
+static boolean
+setting_apply (const char *tag, const byte * value, size_t len)
+{                               // The table part of setting_apply() in ESPRevK.cpp
+   uint32_t hash = revk_hash (tag);
+   unsigned int pos;
+   setting_t *s = setting_find (tag, hash, &pos);
+   boolean had = (s && s->len);
+   if (!had && !len)
+      return true;
+   if (had && len && s->len == len && !memcmp (s->value, value, len))
+      return true;
+   unsigned int newlen = setlen;
+   if (had)
+      newlen -= settingsrec (strlen (tag), s->len);
+   if (len)
+      newlen += settingsrec (strlen (tag), len);
+   if (newlen > SPI_FLASH_SEC_SIZE)
+      return false;
+   if (!s && setcount == setmax)
+   {
+      setmax += 8;
+      set = (setting_t *) realloc (set, setmax * sizeof (*set));
+   }
+   setlen = newlen;
+   if (!s)
+   {
+      memmove (set + pos + 1, set + pos, (setcount - pos) * sizeof (*set));
+      setcount++;
+      s = set + pos;
+      s->hash = hash;
+      s->tag = strdup (tag);
+      s->value = NULL;
+   }
+   free (s->value);
+   s->value = NULL;
+   if (len)
+   {
+      s->value = (byte *) malloc (len + 1);
+      memcpy (s->value, value, len);
+      s->value[len] = 0;
+   }
+   s->len = len;
+   s->dirty = true;
+   settingsupdate = 1;
+   return true;
+}
+
+static uint32_t
+settings_crc (const byte * p, unsigned int len)
+{                               // Same as ESPRevK.cpp
+   uint32_t crc = 0xFFFFFFFF;
+   while (len--)
+   {
+      crc ^= *p++;
+      for (int b = 0; b < 8; b++)
+         crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+   }
+   return ~crc;
+}
+
+static unsigned int
+settings_record (uint32_t * rec, const char *tag, const byte * value, byte len)
+{                               // Same as ESPRevK.cpp
+   unsigned int l = strlen (tag);
+   if (!l || l > SETTINGSTAG)
+      return 0;
+   unsigned int reclen = settingsrec (l, len);
+   rec[reclen / 4 - 1] = 0xFFFFFFFF;    // Padding
+   byte *r = (byte *) rec;
+   r[4] = l;
+   r[5] = len;
+   memcpy (r + 6, tag, l);
+   if (len)
+      memcpy (r + 6 + l, value, len);
+   rec[0] = settings_crc (r + 4, 2 + l + len);
+   return reclen;
+}
+
+static unsigned int
+settings_headok (const uint32_t * head, uint32_t * seq)
+{                               // Same as ESPRevK.cpp
+   const byte *b = (const byte *) head;
+   if (memcmp (b, settingssig, sizeof (settingssig) - 1) || head[1] != settings_crc (b + 8, 5 + b[12]))
+      return 0;
+   *seq = head[2];
+   return settingshead (b[12]);
+}
+
+static int
+settings_pick (uint32_t * head)
+{                               // Same as ESPRevK.cpp
+   uint32_t seq0,
+     seq1;
+   boolean ok0 = (flashRead (0, 0, head, SETTINGSHEAD) && settings_headok (head, &seq0));
+   boolean ok1 = (slots > 1 && flashRead (1, 0, head, SETTINGSHEAD) && settings_headok (head, &seq1));
+   if (ok1 && (!ok0 || (int32_t) (seq1 - seq0) > 0))
+      return 1;
+   if (ok0 && flashRead (0, 0, head, SETTINGSHEAD))
+      return 0;
+   return -1;
+}
+
+static boolean
+settings_write (byte slot, unsigned int addr, uint32_t * rec, unsigned int reclen)
+{                               // Same as ESPRevK.cpp
+   uint32_t check[SETTINGSREC / 4];
+   if (!flashWrite (slot, addr, rec, reclen) || !flashRead (slot, addr, check, reclen) || memcmp (check, rec, reclen))
+      return false;
+   return true;
+}
+
+static boolean
+settings_compact ()
+{                               // Same as ESPRevK.cpp
+   uint32_t rec[SETTINGSREC / 4];
+   byte slot = (slots > 1 ? 1 - settingsslot : 0);
+   if (!flashEraseSector (slot))
+      return false;
+   settingserase++;
+   unsigned int addr = settingshead (appnamelen);
+   setting_t *s;
+   for (s = set; s < set + setcount; s++)
+   {
+      if (!s->len)
+         continue;
+      unsigned int reclen = settings_record (rec, s->tag, s->value, s->len);
+      if (!reclen)
+         continue;
+      if (addr + reclen > SPI_FLASH_SEC_SIZE || !settings_write (slot, addr, rec, reclen))
+         return false;
+      addr += reclen;
+   }
+   {
+      byte *r = (byte *) rec;
+      unsigned int headlen = settingshead (appnamelen);
+      rec[headlen / 4 - 1] = 0xFFFFFFFF;
+      memcpy (r, settingssig, sizeof (settingssig) - 1);
+      rec[2] = settingsseq + 1;
+      r[12] = appnamelen;
+      memcpy (r + 13, appname, appnamelen);
+      rec[1] = settings_crc (r + 8, 5 + appnamelen);
+      if (!settings_write (slot, 0, rec, headlen))
+         return false;
+   }
+   settingsslot = slot;
+   settingsseq++;
+   settingstail = addr;
+   return true;
+}
+
+static boolean
+settings_save ()
+{                               // Same as ESPRevK.cpp
+   if (!settingsupdate)
+      return true;
+   uint32_t rec[SETTINGSREC / 4];
+   setting_t *s;
+   for (s = set; s < set + setcount && settingstail; s++)
+   {
+      if (!s->dirty)
+         continue;
+      unsigned int reclen = settings_record (rec, s->tag, s->value, s->len);
+      if (!reclen)
+         continue;
+      if (settingstail + reclen > SPI_FLASH_SEC_SIZE || !settings_write (settingsslot, settingstail, rec, reclen))
+         settingstail = 0;
+      else
+         settingstail += reclen;
+   }
+   if (!settingstail && !settings_compact ())
+      return false;
+   unsigned int i,
+     o = 0;
+   for (i = 0; i < setcount; i++)
+      if (set[i].len)
+      {
+         set[i].dirty = false;
+         set[o++] = set[i];
+      } else
+      {
+         free (set[i].tag);
+         free (set[i].value);
+      }
+   setcount = o;
+   settingsupdate = 0;
+   return true;
+}
+
+static boolean
+loadsettings ()
+{                               // Same as ESPRevK.cpp, without the old EEPROM format
+   settingsupdate = 1;
+   uint32_t buf[SPI_FLASH_SEC_SIZE / 4];
+   const byte *b = (const byte *) buf;
+   unsigned int addr = 0,
+      i,
+      l;
+   char name[SETTINGSTAG + 1];
+   int slot = settings_pick (buf);
+   if (slot < 0 || !flashRead (slot, 0, buf, SPI_FLASH_SEC_SIZE))
+      return false;
+   addr = settings_headok (buf, &settingsseq);
+   settingsslot = slot;
+   while (addr + 6 <= SPI_FLASH_SEC_SIZE && b[addr + 4] != 0xFF)
+   {
+      l = b[addr + 4];
+      i = b[addr + 5];
+      if (!l || l > SETTINGSTAG || addr + settingsrec (l, i) > SPI_FLASH_SEC_SIZE
+          || buf[addr / 4] != settings_crc (b + addr + 4, 2 + l + i))
+         break;
+      memcpy (name, b + addr + 6, l);
+      name[l] = 0;
+      setting_apply (name, b + addr + 6 + l, i);
+      addr += settingsrec (l, i);
+   }
+   settingstail = addr;
+   for (i = addr; i < SPI_FLASH_SEC_SIZE && b[i] == 0xFF; i++);
+   if (i < SPI_FLASH_SEC_SIZE)
+      settingstail = 0;
+   for (i = 0; i < setcount; i++)
+      set[i].dirty = false;
+   if (settingstail)
+      settingsupdate = 0;
+   return true;
+}
+
+// Test
+
+typedef std::map < std::string, std::string > values_t;
+typedef std::vector < std::pair < std::string, std::string > >records_t;
+
+static values_t
+settings_now ()
+{                               // Settings as loaded
+   values_t v;
+   for (unsigned int i = 0; i < setcount; i++)
+      if (set[i].len)
+         v[set[i].tag] = std::string ((char *) set[i].value, set[i].len);
+   return v;
+}
+
+static void
+change (values_t & want, const char *tag, const std::string & value)
+{                               // Apply change, and to the set we want
+   setting_apply (tag, (const byte *) value.data (), value.size ());
+   if (value.empty ())
+      want.erase (tag);
+   else
+      want[tag] = value;
+}
+
+static void
+pendingrecords (records_t & pending)
+{                               // Records the next save writes, in table order, as settings_save does
+   pending.clear ();
+   for (unsigned int i = 0; i < setcount; i++)
+      if (set[i].dirty)
+         pending.push_back (std::make_pair (std::string (set[i].tag), std::string ((char *) set[i].value ? : "", set[i].len)));
+}
+
+static boolean
+recovered (const values_t & got, const values_t & committed, const records_t & pending)
+{                               // Is got the committed set plus the first n pending records, for some n
+   values_t v = committed;
+   if (got == v)
+      return true;
+   for (auto & p:pending)
+   {
+      if (p.second.empty ())
+         v.erase (p.first);
+      else
+         v[p.first] = p.second;
+      if (got == v)
+         return true;
+   }
+   return false;
+}
+
+#define	TAGS	24              // Different tags used
+
+static int
+run (long cut, int changes, uint32_t seed, long *steps, int *compacts)
+{                               // One run, power cut at step cut (0 for none), returns 0 if OK, 1 if settings lost, 2 if not recovered
+   memset (flash, 0xFF, sizeof (flash));
+   settings_clear ();
+   step = 0;
+   cutat = cut;
+   dead = false;
+   settingserase = 0;
+   r = seed;
+   values_t committed,
+     want;
+   records_t pending;
+   int c;
+   for (c = 0; c < changes && !dead; c++)
+   {
+      int n = 1 + rnd () % 3;
+      while (n--)
+      {
+         char tag[8];
+         snprintf (tag, sizeof (tag), "t%u", rnd () % TAGS);
+         std::string value;
+         int len = rnd () % 8 ? rnd () % 100 : 0;      // Some deletes
+         while ((int) value.size () < len)
+            value += (char) ('A' + rnd () % 26);
+         change (want, tag, value);
+      }
+      pendingrecords (pending);
+      if (settings_save ())
+         committed = want;
+   }
+   *steps = step;
+   *compacts = settingserase;
+   if (!dead)
+      return 0;
+   // Boot after power cut
+   dead = false;
+   cutat = 0;
+   settings_clear ();
+   loadsettings ();
+   values_t got = settings_now ();
+   if (!recovered (got, committed, pending))
+      return 1;
+   // One more change, saved, then boot again
+   committed = got;
+   change (committed, "after", "cut");
+   if (!settings_save ())
+      return 2;
+   settings_clear ();
+   loadsettings ();
+   if (settings_now () != committed)
+      return 2;
+   return 0;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   if (argc > 1)
+      slots = atoi (argv[1]);
+   int changes = (argc > 2 ? atoi (argv[2]) : 200);
+   uint32_t seed = (argc > 3 ? strtoul (argv[3], NULL, 0) : 1) | 1;
+   if (slots < 1 || slots > 2)
+   {
+      fprintf (stderr, "Slots is 1 or 2\n");
+      return 1;
+   }
+   long steps;
+   int compacts;
+   run (0, changes, seed, &steps, &compacts);
+   printf ("%d slot%s, %d changes, %ld flash writes and erases, %d compactions\n", slots, slots > 1 ? "s" : "", changes, steps,
+           compacts);
+   long lost = 0,
+      bad = 0,
+      cut;
+   for (cut = 1; cut <= steps; cut++)
+   {
+      long s;
+      int e = run (cut, changes, seed, &s, &compacts);
+      if (e == 1)
+      {
+         if (!lost++)
+            printf ("Cut at step %ld: settings not recovered\n", cut);
+      } else if (e == 2)
+      {
+         if (!bad++)
+            printf ("Cut at step %ld: save after recovery failed\n", cut);
+      }
+   }
+   printf ("%ld power cuts, %ld lost settings, %ld failed after\n", steps, lost, bad);
+   settings_clear ();
+   free (set);
+   return lost || bad ? 1 : 0;
+}
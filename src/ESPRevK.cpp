@@ -8,11 +8,17 @@
 #define BOARD "generic"
 #endif
 
-#include <ESP8266httpUpdate.h>
-#include <EEPROM.h>
+#include <ESP8266HTTPClient.h>
+#include <Updater.h>
+#include <bearssl/bearssl_hash.h>
 extern "C"
 {
 #include "sntp.h"
+#include "lwip/dns.h"
+#include "lwip/dhcp.h"
+#include "lwip/tcp.h"
+   extern uint32_t _EEPROM_start;       // Linker defined, the EEPROM flash sector
+   extern uint32_t _FS_end;     // Linker defined, end of FS (same as _FS_start if none, OTA image space ends at _FS_start)
 }
 
 //#define GRATARP       10000 // Send gratuitous ARP periodically (no, does not actually help stay on WiFi, FFS)
@@ -22,12 +28,19 @@ extern "C"
 
               // Local functions
 static void myclient (WiFiClient & client);
-static void myclientTLS (WiFiClientSecure &, const byte * sha1 = NULL);
+static unsigned int myclientTLS (WiFiClientSecure &, const byte * sha1 = NULL, const char *host = NULL, uint16_t port = 0);
+static void tlsdone ();
+static boolean tlsmflnstep (const char *host, uint16_t port, byte i);
+static boolean command_cacert (const char *tag, const byte * message, size_t len);
+static void tlssave ();
+static void fastload ();
+static void fastsave (unsigned long s = 0);
 static boolean pub (boolean retain, const char *prefix, const char *suffix, const __FlashStringHelper * fmt, ...);
 static boolean pub (const char *prefix, const char *suffix, const __FlashStringHelper * fmt, ...);
 static boolean pub (const __FlashStringHelper * prefix, const __FlashStringHelper * suffix, const __FlashStringHelper * fmt, ...);
 static boolean pub (boolean retain, const __FlashStringHelper * prefix, const __FlashStringHelper * suffix,
                     const __FlashStringHelper * fmt, ...);
+static void pubdrain (unsigned long now);
 boolean settings_save ();
 boolean setting_apply (const char *name, const byte * value, size_t len);
 
@@ -56,42 +69,110 @@ revk_settings
 #undef n
 typedef struct setting_s setting_t;
 struct setting_s
-{
-   setting_t *next;
+{                               // Settings table is contiguous, sorted by hash, so binary search to find a tag
+   uint32_t hash;               // revk_hash of tag
    const char *tag;             // PROGMEM
-   byte len;
-   const byte value[0];
+   const byte *value;           // In setpacked or setarena, with NULL added
+   const byte **ref;            // Where app (or local) setting keeps value, if known, updated when packed
+   byte len;                    // 0 means deleted, but not yet saved as such
+   boolean dirty;               // Changed since saved
+   boolean known;               // ref is known (NULL if value not kept), else app_setting is called again when packed
 };
-#define	MAXEEPROM 1024          // EEPROM storage
-const char eepromsig[] = "RevK";
-static setting_t *set = NULL;   // The settings
-static unsigned int setlen = sizeof (eepromsig) + 1;
+// Settings are an append only log, so a change only writes its own record
+// Slot A is the EEPROM sector, which is ours. Slot B is the sector below it, which is normally the last FS sector, or the end
+// of the OTA image space if no FS, so is only used if the linker script ends the FS (_FS_end) at least a sector below EEPROM
+// Header is sig, CRC, sequence, app name len, app name, padded to 4 bytes, CRC is CRC32 from sequence to end of app name
+// Records are CRC, tag len, value len, tag, value, padded to 4 bytes, latest for a tag wins, value len 0 for delete
+// End of log is erased flash (0xFF) or a bad record CRC (interrupted write)
+// When the log is full it is compacted in to the other slot, header written last, so a power cut leaves the old slot valid
+// With only slot A it is compacted in place, as the old EEPROM library did, so a power cut during compaction loses settings
+// Boot uses the valid header with latest sequence, and reads only that slot
+#define	SETTINGSSECTOR(n)	(((uint32_t)&_EEPROM_start - 0x40200000) / SPI_FLASH_SEC_SIZE - (n))
+#define	SETTINGSSLOTS	((uint32_t)&_FS_end + SPI_FLASH_SEC_SIZE <= (uint32_t)&_EEPROM_start ? 2 : 1)
+#define	SETTINGSTAG	32      // Max tag len
+#define	SETTINGSREC	settingspad(6+SETTINGSTAG+255)   // Max record len (padded)
+#define	SETTINGSHEAD	settingspad(13+255)     // Max header len (padded)
+#define settingspad(l)	(((l)+3)&~3)
+#define settingsrec(t,l)	settingspad(6+(t)+(l))
+#define settingshead(a)	settingspad(13+(a))
+const char settingssig[] = "RevS";
+const char eepromsig[] = "RevK";        // Old format (whole image, via EEPROM library)
+static setting_t *set = NULL;   // The settings (table)
+static unsigned int setcount = 0;       // Entries in set
+static unsigned int setmax = 0; // Allocated entries in set
+static unsigned int setlen = settingshead (0);  // Size if compacted
+// Values are not malloc'd separately, they are packed in one buffer, and new values go in a small arena
+// Replaced values are left in place until the next pack (arena full), which moves all values to a new buffer
+// Anything keeping a value pointer outside the settings callbacks (WiFi creds, SNTP server) has to keep a copy instead
+// On load the arena is the buffer read from flash, values being moved down it as each record is read
+#define	SETTINGSARENA	256     // Arena size, must allow for max value and NULL
+static byte *setpacked = NULL;  // Packed values
+static byte *setarena = NULL;   // New values
+static unsigned int setarenasize = 0;
+static unsigned int setarenaused = 0;
+static unsigned int settingstail = 0;   // Where next record goes in log, 0 to compact on next save
+static unsigned int settingserase = 0;  // Count of sector erases
+static byte settingsslot = 0;   // Active slot
+static uint32_t settingsseq = 0;        // Sequence of active slot
 static long settingsupdate = 0; // When to do a settings update (delay after settings changed, 0 if no change)
+static byte settingsbatch = 0;  // Batch being applied, and restart/reconnect it needs
+#define	SETTINGSBATCHON		1
+#define	SETTINGSBATCHRESTART	2
+#define	SETTINGSBATCHMQTT	4
 
       // Local variables
 WiFiClient mqttclient;
 WiFiClientSecure mqttclientsecure;
 PubSubClient mqtt;
-boolean mqttbackup = false;
-long mqttbackoff = 100;
+byte mqttbroker = 0;            // Broker in use (0 is mqtthost)
+long mqttbackoff = 100;         // Doubles on each failure, try at WiFi level when at retrymax
 long mqttretry = mqttbackoff;
+long mqttdelay = 0;             // Last (jittered) retry delay
+long mqttholdoff = 0;           // Do not reconnect before this (retryafter command)
+static boolean mqttswitch = false;      // Disconnected on purpose to move to better broker, so no backoff
 int mqttcount = 0;
+static unsigned long tlshit = 0;        // TLS sessions resumed
+static unsigned long tlsmiss = 0;       // TLS full handshakes
+static unsigned int mqttmfln = 0;       // TLS max fragment length for MQTT connection (0 if not negotiated)
+static unsigned int mqttheap = 0;       // Heap used by MQTT connection
+static unsigned long pubfirst = 0;      // ms from boot to first publish
+static boolean fastused = false;        // Reconnect details were loaded from RTC memory
+static unsigned long fastleaseend = 0;  // When static IP from RTC has to go back to DHCP (0 if not using it)
+static uint32_t fastbroker = 0; // revk_hash of broker name from RTC
+static uint32_t fastbrokerip = 0;       // and its address, used once instead of DNS
+
+static uint32_t
+jitter ()
+{                               // Pseudo random, seeded from chip ID, so devices differ
+   static uint32_t r = 0;
+   if (!r)
+      r = (ESP.getChipId () * 2654435761U) | 1;
+   r ^= r << 13;                // xorshift32
+   r ^= r >> 17;
+   r ^= r << 5;
+   return r;
+}
 
-static const char *
-strdup_P (const char *p)
-{
-   const char *m = (const char *) malloc (strlen_P (p) + 1);
-   strcpy_P ((char *) m, p);
-   return m;
+static long
+backoff (long *prev)
+{                               // Decorrelated jitter, random between retrymin and 3 times previous delay, up to retrymax
+   uint32_t r = jitter ();
+   long lo = (retrymin > 0 ? retrymin : 1),
+      hi = (*prev > lo ? *prev : lo) * 3;      // Previous starts at retrymin (prev 0), so first delay is jittered too
+   if (hi > retrymax)
+      hi = retrymax;
+   if (hi <= lo)
+      hi = lo + 1;
+   return *prev = lo + r % (hi - lo);
 }
 
 static int wificount = 0;       // Count of connects
 static volatile int wifidiscause = -1;  // Last disconnect cause
 
-static const char *thisssid = NULL;     // Last creds used
-static const char *lastssid = NULL;     // Last creds used
-static const char *thispass = NULL;
-static const char *lastpass = NULL;
+static char thisssid[33] = "";  // Creds being tried (copies, as settings values move when packed)
+static char lastssid[33] = "";  // Last creds used
+static char thispass[65] = "";
+static char lastpass[65] = "";
 static const byte *thisbssid = NULL;
 static const byte *lastbssid = NULL;
 static byte thischan = 0;
@@ -101,6 +182,38 @@ static boolean lastbssidfixed = false;
 
 static const byte copybssid[6] = { };
 
+// Roaming, only if not locked to a BSSID, scans are only on channels the SSID has been seen on, with a full scan every ROAMFULL
+// APs are remembered with RSSI smoothed over scans, and we move only if one is roammargin dB better than the current (smoothed)
+// and not within roammin s of the last move, an AP we leave within ROAMFLAP s of moving to it is skipped for a while (doubling)
+#define	ROAMAPS		8       // APs remembered
+#define	ROAMFULL	6       // Every this many scan cycles is all channels
+#define	ROAMFLAP	600     // s, leaving an AP within this of joining is a flap
+#define	ROAMSKIPMAX	86400   // s, max time to skip a flapping AP
+#define	ROAMGAP		200     // ms between channel scans, so traffic can flow
+typedef struct roamap_s roamap_t;
+struct roamap_s
+{
+   byte bssid[6];
+   byte chan;
+   byte flaps;                  // Times we left soon after joining
+   int rssi;                    // Smoothed from scans
+   unsigned long seen;          // When last seen in a scan
+   unsigned long joined;        // When we last moved to it
+   unsigned long skip;          // Do not move to it until this (0 if not skipping)
+};
+static roamap_t roamap[ROAMAPS];
+static uint16_t roamchans = 0;  // Channels SSID seen on (bit per channel)
+static uint16_t roampending = 0;        // Channels still to scan this cycle (bit 0 for all channels)
+static unsigned long roamcycle = 0;     // Start of scan cycle
+static byte roamcycles = 0;
+static int roamrssi = 0;        // Smoothed RSSI of current AP
+static unsigned long roamlast = 0;      // Last move, or connect
+static unsigned long roamstart = 0;     // When current move started (0 if none)
+static int roamfrom = 0;        // RSSI before last move
+static unsigned long roamcount = 0;     // Stats
+static unsigned long roamcost = 0;      // Total ms from move to MQTT connected again
+static unsigned long roammax = 0;
+
 static WiFiEventHandler wifidisconnecthandler = NULL;
 static void
 wifidisconnect (const WiFiEventStationModeDisconnected & event)
@@ -108,6 +221,14 @@ wifidisconnect (const WiFiEventStationModeDisconnected & event)
    wifidiscause = event.reason;
 }
 
+static boolean
+wififixed (const byte * bssid)
+{                               // If BSSID is one set in settings, so we stay on it and do not roam
+   return bssid && ((wifibssid && !memcmp (wifibssid, bssid, sizeof (copybssid)))
+                    || (wifibssid2 && !memcmp (wifibssid2, bssid, sizeof (copybssid)))
+                    || (wifibssid3 && !memcmp (wifibssid3, bssid, sizeof (copybssid))));
+}
+
 static void
 wifitry (const char *ssid, const char *passphrase, int32_t channel, const uint8_t * bssid)
 {                               // try a connection and confirm if it worked
@@ -124,23 +245,26 @@ wifitry (const char *ssid, const char *passphrase, int32_t channel, const uint8_
       WiFi.disconnect ();
       delay (100);
    }
-   thisssid = ssid;
-   thispass = passphrase;
+   strncpy (thisssid, ssid, sizeof (thisssid) - 1);
+   strncpy (thispass, passphrase ? : "", sizeof (thispass) - 1);
    thischan = channel;
+   thisbssidfixed = wififixed (bssid);
    if (bssid)
    {
-      thisbssidfixed = true;
       memcpy ((void *) copybssid, (void *) bssid, sizeof (copybssid));
       thisbssid = copybssid;
-   }
+   } else
+      thisbssid = NULL;         // Any AP, not the one from a previous try
    wifidiscause = 0;            // Stays 0 until we fail or later disconnect
-   WiFi.begin (thisssid, thispass, thischan, thisbssid, true);
+   WiFi.begin (thisssid, *thispass ? thispass : NULL, thischan, thisbssid, true);
 }
 
 static boolean
 wificonnect ()
 {                               // Try and reconnect
    static int wifiseq = 0;
+   static long wifiretry = 0;   // Backoff when tried all
+   static long wifidelay = 0;
    if (!wifidiscause)
    {                            // We are trying, or connected
       if (!WiFi.isConnected ())
@@ -152,369 +276,1911 @@ wificonnect ()
          memcpy ((void *) copybssid, (void *) WiFi.BSSID (), sizeof (copybssid));
          thisbssid = copybssid;
       }
-      lastssid = thisssid;
-      lastpass = thispass;
+      strcpy (lastssid, thisssid);
+      strcpy (lastpass, thispass);
       lastchan = thischan;
       lastbssid = thisbssid;
       lastbssidfixed = thisbssidfixed;
       debugf ("WiFi connected %s %d %02X:%02X:%02X:%02X:%02X:%02X RSSI %d", lastssid, lastchan, lastbssid[0], lastbssid[1],
               lastbssid[2], lastbssid[3], lastbssid[4], lastbssid[5], WiFi.RSSI ());
+      roamrssi = WiFi.RSSI ();
+      roamlast = (millis ()? : 1);
       wifiseq = 0;
+      wifiretry = 0;
+      wifidelay = 0;
       return true;
    }
    // Let's try and connect
+   if (!wifiseq && wifiretry && (int) (wifiretry - millis ()) > 0)
+      return false;             // Backing off before trying all again
    wificount++;                 // Connect attempt count
+   if (fastleaseend && wificount > 1)
+   {                            // Static IP from RTC is only for the first try
+      fastleaseend = 0;
+      WiFi.config (0U, 0U, 0U);
+   }
    if (wifiseq >= 3 && wifissid3)
       wifitry (wifissid3, wifipass3, wifichan3, wifibssid3);
    else if (wifiseq >= 2 && wifissid2)
       wifitry (wifissid2, wifipass2, wifichan2, wifibssid2);
    else if (wifiseq >= 1 && wifissid)
       wifitry (wifissid, wifipass, wifichan, wifibssid);
-   else if (lastssid)
-      wifitry (lastssid, lastpass, lastchan, lastbssid);
+   else if (*lastssid)
+      wifitry (lastssid, *lastpass ? lastpass : NULL, lastchan, lastbssid);
    wifiseq++;
    if (wifiseq == 4)
+   {                            // Tried all
       wifiseq = 0;
+      wifiretry = ((millis () + backoff (&wifidelay)) ? : 1);
+   }
    return false;
 }
 
+static roamap_t *
+roamfind (const byte * bssid)
+{                               // Find AP, or replace the one not seen for longest
+   roamap_t *old = roamap;
+   for (roamap_t * a = roamap; a < roamap + ROAMAPS; a++)
+   {
+      if (!memcmp (a->bssid, bssid, sizeof (a->bssid)))
+         return a;
+      if ((int) (a->seen - old->seen) < 0)
+         old = a;
+   }
+   memset (old, 0, sizeof (*old));
+   memcpy (old->bssid, bssid, sizeof (old->bssid));
+   return old;
+}
+
 static void
 wifiscan ()
-{                               // Check for stronger signal if we are not locked to a bssid
+{                               // Check for better AP if we are not locked to a bssid
    static long scannext = 1000;
+   static long rssinext = 0;
    if (lastbssidfixed)
       return;                   // Fixed BSSID
-   if (scannext && (int) (scannext - millis ()) >= 0)
+   unsigned long now = (millis ()? : 1);
+   if ((int) (rssinext - now) <= 0)
+   {                            // Smooth RSSI of current AP
+      rssinext = now + 1000;
+      roamrssi = (roamrssi * 3 + WiFi.RSSI ()) / 4;
+   }
+   if (scannext && (int) (scannext - now) >= 0)
       return;                   // Waiting
    if (scannext)
-   {                            // Start a scan
-      //debug ("WiFi scan");
+   {                            // Start a scan, of one channel, or all
       scannext = 0;
-      WiFi.scanNetworks (true, false, 0, (uint8 *) lastssid);
+      if (!roampending)
+      {                         // New cycle
+         roamcycle = now;
+         roampending = ((roamcycles++ % ROAMFULL && roamchans) ? roamchans : 1);
+      }
+      byte chan = 0;
+      while (!(roampending & (1 << chan)))
+         chan++;
+      roampending &= ~(1 << chan);
+      WiFi.scanNetworks (true, false, chan, (uint8 *) lastssid);
       return;
    }
    int n = WiFi.scanComplete ();
+   if (n == WIFI_SCAN_FAILED)
+   {                            // Try again later
+      roampending = 0;
+      scannext = (now + WIFISCANRATE * 1000 ? : 1);
+      return;
+   }
    if (n < 0)
       return;
    debugf ("WiFi scan found %d", n);
-   scannext = (millis () + WIFISCANRATE * 1000 ? : 1);  // Next scan
-   int best = -1,
-      bestrssi = 0;
    while (n--)
-   {                            // Check for better signal
-      if (best < 0 || WiFi.RSSI (n) > bestrssi)
+   {
+      roamap_t *a = roamfind (WiFi.BSSID (n));
+      int rssi = WiFi.RSSI (n);
+      a->rssi = (a->seen ? (a->rssi + rssi) / 2 : rssi);
+      a->seen = now;
+      a->chan = WiFi.channel (n);
+      if (a->chan < 16)
+         roamchans |= (1 << a->chan);
+   }
+   WiFi.scanDelete ();
+   if (roampending)
+   {                            // Next channel
+      scannext = now + ROAMGAP;
+      return;
+   }
+   scannext = (now + WIFISCANRATE * 1000 ? : 1);        // Next scan
+   roamap_t *best = NULL;
+   for (roamap_t * a = roamap; a < roamap + ROAMAPS; a++)
+      if (a->seen && (int) (a->seen - roamcycle) >= 0 && memcmp (a->bssid, WiFi.BSSID (), sizeof (a->bssid))
+          && (!a->skip || (int) (a->skip - now) <= 0) && (!best || a->rssi > best->rssi))
+         best = a;
+   if (!best || best->rssi < roamrssi + roammargin)
+      return;                   // Not better enough
+   if ((int) (now - roamlast) < roammin * 1000)
+   {
+      debugf ("WiFi better %d RSSI %d, but moved recently", best->chan, best->rssi);
+      return;
+   }
+   roamap_t *cur = roamfind (WiFi.BSSID ());
+   if (cur->joined && (int) (now - cur->joined) < ROAMFLAP * 1000)
+   {                            // Flapping, skip for a while
+      unsigned long s = ((unsigned long) ROAMFLAP << (cur->flaps < 8 ? cur->flaps : 8));
+      cur->skip = (now + (s < ROAMSKIPMAX ? s : ROAMSKIPMAX) * 1000 ? : 1);
+      if (cur->flaps < 255)
+         cur->flaps++;
+   }
+   best->joined = now;
+   roamfrom = roamrssi;
+   roamcount++;
+   roamstart = now;
+   lastchan = best->chan;
+   memcpy ((void *) (lastbssid = copybssid), (void *) best->bssid, sizeof (copybssid));
+   debugf ("WiFi better %d %02X:%02X:%02X:%02X:%02X:%02X RSSI %d was %d", lastchan, lastbssid[0], lastbssid[1], lastbssid[2],
+           lastbssid[3], lastbssid[4], lastbssid[5], best->rssi, roamrssi);
+   WiFi.disconnect ();
+}
+
+
+#define	TOPICMAX	100     // Max topic len
+static const char **const topicprefix[] = { &prefixcommand, &prefixsetting, &prefixstate, &prefixevent, &prefixinfo, &prefixerror };
+
+#define	TOPICSTEMS	(sizeof(topicprefix)/sizeof(*topicprefix))
+static char *topicstem = NULL;  // Cached prefix/app/hostname for each of topicprefix, NULL separated, freed if prefix or hostname changed
+static byte topicstemlen[TOPICSTEMS];
+
+static unsigned int
+topicmake (char *topic, const char *prefix, boolean prefixP, const char *suffix, boolean suffixP)
+{                               // Make prefix/app/hostname[/suffix] in topic[TOPICMAX+1], prefix/suffix PROGMEM if P, return length
+   unsigned int l,
+     p = TOPICSTEMS,
+      q;
+   if (!prefixP)
+      for (p = 0; p < TOPICSTEMS && *topicprefix[p] != prefix; p++);
+   if (p < TOPICSTEMS && !topicstem)
+   {                            // Make stems
+      unsigned int size = 0;
+      for (q = 0; q < TOPICSTEMS; q++)
       {
-         bestrssi = WiFi.RSSI (n);
-         best = n;
+         l = strlen (*topicprefix[q] ? : "") + 1 + appnamelen + 1 + strlen (hostname);
+         size += (topicstemlen[q] = (l > TOPICMAX ? TOPICMAX : l)) + 1;
+      }
+      char *o = topicstem = (char *) malloc (size);
+      for (q = 0; o && q < TOPICSTEMS; q++)
+      {
+         snprintf_P (o, topicstemlen[q] + 1, PSTR ("%s/%.*s/%s"), *topicprefix[q] ? : "", appnamelen, appname, hostname);
+         o += topicstemlen[q] + 1;
       }
    }
-   if (best >= 0 && bestrssi > WiFi.RSSI () && memcmp ((void *) lastbssid, (void *) WiFi.BSSID (best), 6))
-   {                            // Switch to better wifi
-      lastchan = WiFi.channel (best);
-      memcpy ((void *) (lastbssid = copybssid), (void *) WiFi.BSSID (best), sizeof (copybssid));
-      if (best >= 0)
-         debugf ("WiFi better %d %02X:%02X:%02X:%02X:%02X:%02X RSSI %d", lastchan, lastbssid[0], lastbssid[1], lastbssid[2],
-                 lastbssid[3], lastbssid[4], lastbssid[5], bestrssi);
-      WiFi.disconnect ();
+   if (p < TOPICSTEMS && topicstem)
+   {                            // Cached
+      const char *c = topicstem;
+      for (q = 0; q < p; q++)
+         c += topicstemlen[q] + 1;
+      memcpy (topic, c, l = topicstemlen[p]);
+   } else
+   {
+      snprintf_P (topic, TOPICMAX + 1, prefixP ? PSTR ("%S/%.*s/%s") : PSTR ("%s/%.*s/%s"), prefix, appnamelen, appname,
+                  hostname);
+      l = strlen (topic);
    }
-   WiFi.scanDelete ();
+   if (suffix && l < TOPICMAX)
+   {
+      topic[l++] = '/';
+      q = (suffixP ? strlen_P (suffix) : strlen (suffix));
+      if (q > TOPICMAX - l)
+         q = TOPICMAX - l;
+      if (suffixP)
+         memcpy_P (topic + l, suffix, q);
+      else
+         memcpy (topic + l, suffix, q);
+      l += q;
+   }
+   topic[l] = 0;
+   return l;
+}
+
+// Retained state cache, if statecache set, hash of last payload sent per topic, so unchanged state is not sent again
+// Cleared on connect, so the next state sent is always re-asserted
+typedef struct statecache_s statecache_t;
+struct statecache_s
+{
+   uint32_t topic;              // Hash of topic
+   uint32_t payload;            // Hash of payload
+};
+static statecache_t *statecachetable = NULL;
+static unsigned int statecachemax = 0;  // Allocated entries
+static unsigned int statecachecount = 0;        // Used entries
+static unsigned int statecachenext = 0; // Next to replace when full
+static unsigned long statesent = 0;     // Stats
+static unsigned long statesuppressed = 0;
+
+static uint32_t
+statehash (const byte * data, unsigned int len, uint32_t h = 2166136261U)
+{                               // FNV-1a
+   while (len--)
+      h = (h ^ *data++) * 16777619U;
+   return h;
 }
 
+static statecache_t *
+statecachefind (uint32_t topic)
+{                               // Find (or make) entry for topic, NULL if cache not in use
+   if (statecache <= 0)
+   {
+      if (statecachetable)
+      {
+         free (statecachetable);
+         statecachetable = NULL;
+         statecachemax = statecachecount = 0;
+      }
+      return NULL;
+   }
+   if (statecachemax != (unsigned int) statecache)
+   {                            // (Re)allocate
+      free (statecachetable);
+      statecachecount = statecachenext = 0;
+      if (!(statecachetable = (statecache_t *) malloc (sizeof (*statecachetable) * statecache)))
+      {
+         statecachemax = 0;
+         return NULL;
+      }
+      statecachemax = statecache;
+   }
+   for (unsigned int i = 0; i < statecachecount; i++)
+      if (statecachetable[i].topic == topic)
+         return &statecachetable[i];
+   statecache_t *c;
+   if (statecachecount < statecachemax)
+      c = &statecachetable[statecachecount++];
+   else
+   {                            // Replace oldest added
+      c = &statecachetable[statecachenext++];
+      if (statecachenext == statecachemax)
+         statecachenext = 0;
+   }
+   c->topic = topic;
+   c->payload = 0;
+   return c;
+}
 
 static long wifidown = 0;
-static boolean
-domqttopen (boolean silent = false)
+
+// MQTT connect is done in steps from loop, so the app is not held up for the whole connect
+// DNS is asynchronous, TCP (and TLS) connect and MQTT CONNECT/CONNACK are each one step with a time limit, then one subscribe per step
+// A TLS host not seen before has its max fragment length probed first, one probe connection per step
+#define	MQTTIDLE	0       // MQTT connect phases
+#define	MQTTRESOLVE	1
+#define	MQTTCONNECT	2
+#define	MQTTSESSION	3
+#define	MQTTSUBSCRIBE	4
+#define	MQTTANNOUNCE	5
+#define	MQTTMFLN	6
+#define	MQTTDNSWAIT	5000    // ms for DNS
+#define	MQTTCONNECTWAIT	3000    // ms for TCP (and TLS) connect
+#define	MQTTSESSIONWAIT	5       // s for CONNACK
+#define	MQTTBUFFER	2048    // MQTT buffer, the largest message (topic and payload) that can be received, e.g. cacert PEM
+static byte mqttphase = MQTTIDLE;
+static byte mqttsub = 0;        // Next subscribe
+static boolean mqttsilent = false;
+static unsigned long mqttphasestart = 0;
+static unsigned int mqtttime[4];        // ms for DNS, connect, CONNECT/CONNACK, subscribes
+static unsigned int mqttprobe = 0;      // ms of connect time that was MFLN probe connections
+static byte mqttmflni = 0;      // Next MFLN probe size
+static volatile byte mqttdns = 0;       // 0 waiting, 1 found, 2 failed
+static IPAddress mqttip;
+
+// Brokers are mqtthost, mqtthost2, mqtthost3, each can be host:port, and is TLS if matching mqttsha1, mqttsha12, mqttsha13 set
+// Each connect uses the broker with lowest score, which is connect time, plus a bit for place in list, plus a lot per recent failure
+// When not on the best broker, the best one is probed periodically, and if it answers we move back to it
+// The probe is in steps from loop, async DNS then a raw (lwIP) TCP connect, so it does not hold up the app
+#define	MQTTBROKERS	3
+#define	MQTTORDERCOST	100     // ms added to score per place in list
+#define	MQTTFAILCOST	10000   // ms added to score per consecutive failure
+#define	MQTTFAILFORGET	300000  // ms after which failures are not counted in score
+#define	MQTTLATENCY	1000    // ms connect time assumed if none measured
+#define	MQTTSWITCH	500     // ms better score needed to move to another broker
+#define	MQTTPROBE	60000   // ms between probes of better broker
+#define	MQTTPROBEWAIT	1000    // ms for probe TCP connect
+#define	PROBEIDLE	0       // Probe phases
+#define	PROBERESOLVE	1
+#define	PROBECONNECT	2
+typedef struct broker_s broker_t;
+struct broker_s
 {
-   const char *host = (mqttbackup ? mqtthost2 : mqtthost);
-   if (!host)
-      return false;
-   mqttcount++;
-   if (mqttbackup)
-   {
-      debugf ("MQTT backup insecure %s", mqtthost2);
-      myclient (mqttclient);
-      //mqttclient.setNoDelay (true);
-      mqtt.setClient (mqttclient);
-      mqtt.setServer (mqtthost2, 1883);
+   unsigned int latency;        // Smoothed connect time (ms)
+   byte fails;                  // Consecutive failures
+   unsigned long lastfail;      // When last failed
+   unsigned long connects;      // Stats
+   unsigned long failures;
+};
+static broker_t broker[MQTTBROKERS];
+static char mqttname[65];       // Host name of broker in use, without port
+static int mqttserverport = 0;  // Port of broker in use
+static byte probephase = PROBEIDLE;
+static byte probebroker = 0;    // Broker being probed
+static int probeport = 0;
+static unsigned long probestart = 0;    // Start of probe phase
+static volatile byte probestate = 0;    // 0 waiting, 1 worked, 2 failed
+static byte probeseq = 0;       // So callbacks for an abandoned probe are ignored
+static ip_addr_t probeip;
+static struct tcp_pcb *probepcb = NULL;
+
+static const char *
+brokerhost (byte n)
+{                               // Host setting for broker
+   return n == 0 ? mqtthost : n == 1 ? mqtthost2 : n == 2 ? mqtthost3 : NULL;
+}
+
+static const byte *
+brokersha1 (byte n)
+{                               // TLS fingerprint for broker, NULL for non TLS
+   return n == 0 ? mqttsha1 : n == 1 ? mqttsha12 : n == 2 ? mqttsha13 : NULL;
+}
+
+static int
+brokername (byte n, char *name, size_t len)
+{                               // Host name, without any port, returns port
+   const char *h = brokerhost (n),
+      *c = strrchr (h, ':');
+   size_t l = (c ? c - h : strlen (h));
+   if (l >= len)
+      l = len - 1;
+   memcpy (name, h, l);
+   name[l] = 0;
+   if (c)
+      return atoi (c + 1);
+   if (!n && mqttport)
+      return atoi (mqttport);
+   return brokersha1 (n) ? 8883 : 1883;
+}
+
+static long
+brokerscore (byte n, unsigned long now, boolean fails = true)
+{                               // Lower is better, -1 if no such broker
+   const char *h = brokerhost (n);
+   if (!h || !*h)
+      return -1;
+   broker_t *b = &broker[n];
+   long s = (b->latency ? : broker[mqttbroker].latency ? : MQTTLATENCY) + n * MQTTORDERCOST;       // Not measured, assume same as current
+   if (fails && b->fails && (int) (now - b->lastfail) < MQTTFAILFORGET)
+      s += (long) b->fails * MQTTFAILCOST;
+   return s;
+}
+
+static byte
+brokerbest (unsigned long now, boolean fails = true)
+{                               // Pick best broker
+   byte best = 0;
+   long bestscore = -1;
+   for (byte n = 0; n < MQTTBROKERS; n++)
+   {
+      long s = brokerscore (n, now, fails);
+      if (s >= 0 && (bestscore < 0 || s < bestscore))
+      {
+         best = n;
+         bestscore = s;
+      }
+   }
+   return best;
+}
+
+static void
+probednsfound (const char *name, const ip_addr_t * ip, void *arg)
+{                               // DNS callback for probe
+   if ((byte) (intptr_t) arg != probeseq || probephase != PROBERESOLVE)
+      return;                   // Old lookup
+   if (ip)
+   {
+      probeip = *ip;
+      probestate = 1;
    } else
+      probestate = 2;
+}
+
+static err_t
+probeconnected (void *arg, struct tcp_pcb *pcb, err_t err)
+{                               // TCP connected, which is all the probe needs
+   probepcb = NULL;
+   probestate = 1;
+   tcp_arg (pcb, NULL);
+   tcp_err (pcb, NULL);
+   if (tcp_close (pcb) != ERR_OK)
+   {
+      tcp_abort (pcb);
+      return ERR_ABRT;
+   }
+   return ERR_OK;
+}
+
+static void
+probeerr (void *arg, err_t err)
+{                               // TCP failed, pcb already freed
+   probepcb = NULL;
+   probestate = 2;
+}
+
+static void
+probestop ()
+{                               // Abandon probe
+   if (probepcb)
    {
-      if (mqttsha1)
+      tcp_arg (probepcb, NULL);
+      tcp_err (probepcb, NULL);
+      tcp_abort (probepcb);
+      probepcb = NULL;
+   }
+   probephase = PROBEIDLE;
+}
+
+static void
+brokerprobe (unsigned long now)
+{                               // If not on best broker, check if it is working, and move if it is
+   static unsigned long next = 0;
+   switch (probephase)
+   {
+   case PROBEIDLE:
       {
-         debugf ("MQTT main secure %s", mqtthost);
-         myclientTLS (mqttclientsecure, mqttsha1);
-         //mqttclientsecure.setNoDelay (true);
-         mqtt.setClient (mqttclientsecure);
-         mqtt.setServer (mqtthost, mqttport ? atoi (mqttport) : 8883);
-      } else
+         if ((int) (next - now) > 0)
+            return;
+         next = now + MQTTPROBE;
+         byte n = brokerbest (now, false);      // Best if working, the probe will tell us
+         long s = brokerscore (n, now, false),
+            c = brokerscore (mqttbroker, now, false);
+         if (n == mqttbroker || s >= c || (n > mqttbroker && s + MQTTSWITCH > c))
+            return;             // Good where we are (always move back up the list, only move down if a lot faster)
+         char name[sizeof (mqttname)];
+         probeport = brokername (n, name, sizeof (name));
+         probebroker = n;
+         probestate = 0;
+         probeseq++;
+         probestart = now;
+         probephase = PROBERESOLVE;
+         err_t e = dns_gethostbyname (name, &probeip, probednsfound, (void *) (intptr_t) probeseq);
+         if (e == ERR_OK)
+            probestate = 1;     // Cached, or literal
+         else if (e != ERR_INPROGRESS)
+            probestate = 2;
+      }
+      return;
+   case PROBERESOLVE:
+      if (!probestate && (int) (now - probestart) < MQTTDNSWAIT)
+         return;                // Waiting
+      if (probestate != 1)
+         break;
+      probestate = 0;
+      probestart = now;
+      probephase = PROBECONNECT;
+      if (!(probepcb = tcp_new ()))
       {
-         debugf ("MQTT main insecure %s", mqtthost);
-         myclient (mqttclient);
-         mqtt.setClient (mqttclient);
-         //mqttclient.setNoDelay (true);
-         mqtt.setServer (mqtthost, mqttport ? atoi (mqttport) : 1883);
+         probephase = PROBEIDLE;        // No memory, not the broker's fault, try next time
+         return;
       }
+      tcp_arg (probepcb, NULL);
+      tcp_err (probepcb, probeerr);
+      if (tcp_connect (probepcb, &probeip, probeport, probeconnected) != ERR_OK)
+         break;
+      return;
+   case PROBECONNECT:
+      if (!probestate && (int) (now - probestart) < MQTTPROBEWAIT)
+         return;                // Waiting
+      if (probestate != 1)
+         break;
+      probephase = PROBEIDLE;
+      broker[probebroker].fails = 0;    // Working again
+      debugf ("MQTT moving to %s", brokerhost (probebroker));
+      pub (true, prefixstate, NULL, F ("0 Moving broker"));
+      mqtt.disconnect ();
+      mqttswitch = true;        // Reconnect now, to best
+      return;
    }
-   char topic[101];
-   snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/%s"), prefixstate, appnamelen, appname, hostname);
-   if (!mqtt.connect (hostname, mqttbackup ? NULL : mqttuser, mqttbackup ? NULL : mqttpass, topic, MQTTQOS1, true, "0 Fail"))
-      return false;
-   // Worked
-   mqttretry = 0;
-   mqttbackoff = 1000;
-   // Specific device
-   snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/%s/#"), prefixcommand, appnamelen, appname, hostname);
-   mqtt.subscribe (topic);
-   snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/%s/#"), prefixsetting, appnamelen, appname, hostname);
-   mqtt.subscribe (topic);
-   // All devices
-   snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/*/#"), prefixcommand, appnamelen, appname);
-   mqtt.subscribe (topic);
-   snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/*/#"), prefixsetting, appnamelen, appname);
-   mqtt.subscribe (topic);
-   debugf ("MQTT connected %s", host);
-   if (silent)
-      return true;
-   pub (true, prefixstate, NULL, F ("1 %s"), appversion);
-   unsigned int now = millis ();
-   pub (prefixinfo, NULL,
-        F ("%S %d.%03d, flash %dKiB, W%d M%d, WiFi %s %d %02X:%02X:%02X:%02X:%02X:%02X RSSI %d Down %d.%03d"),
-        mqttbackup ? PSTR ("Backup") : PSTR ("Up"),
-        now / 1000, now % 1000, ESP.getFlashChipRealSize () / 1024, wificount, mqttcount, lastssid, lastchan,
-        lastbssid[0], lastbssid[1], lastbssid[2], lastbssid[3], lastbssid[4], lastbssid[5], WiFi.RSSI (),
-        wifidown / 1000, wifidown % 1000);
-   app_command ("connect", (const byte *) host, strlen ((char *) host));
-   return true;
+   probestop ();                // Failed
+   if (broker[probebroker].fails < 255)
+      broker[probebroker].fails++;
+   broker[probebroker].lastfail = now;
+}
+
+#define	mqttup()	(mqtt.connected () && (mqttphase == MQTTIDLE || mqttphase >= MQTTSUBSCRIBE))    // OK to publish
+
+static void
+mqttdnsfound (const char *name, const ip_addr_t * ip, void *arg)
+{                               // DNS callback
+   if ((intptr_t) arg != mqttcount)
+      return;                   // Old lookup
+   if (ip)
+   {
+      mqttip = IPAddress (ip);
+      mqttdns = 1;
+   } else
+      mqttdns = 2;
+}
+
+static void
+mqttstop ()
+{                               // Abandon connect
+   mqttclient.stop ();
+   mqttclientsecure.stop ();
+   mqttphase = MQTTIDLE;
+   probestop ();
+}
+
+static int
+mqttfail ()
+{                               // Abandon connect, and count against broker
+   broker_t *b = &broker[mqttbroker];
+   if (b->fails < 255)
+      b->fails++;
+   b->lastfail = millis ();
+   b->failures++;
+   mqttstop ();
+   return -1;
 }
 
-#define PCPY(x) strdup_P(PSTR(x))
+static int
+mqttstep (boolean silent = false)
+{                               // Next step of MQTT connect, 1 if connected, 0 if still going, -1 if failed
+   const char *host = mqttname;
+   unsigned long now = millis ();
+   if (mqttphase == MQTTIDLE)
+   {                            // Pick broker
+      mqttbroker = brokerbest (now);
+      if (brokerscore (mqttbroker, now) < 0)
+         return -1;             // None
+      mqttserverport = brokername (mqttbroker, mqttname, sizeof (mqttname));
+   }
+   switch (mqttphase)
+   {
+   case MQTTIDLE:
+      {
+         mqttcount++;
+         mqttsilent = silent;
+         if (mqtt.getBufferSize () < MQTTBUFFER)
+            mqtt.setBufferSize (MQTTBUFFER);    // Stays at default if no memory
+         memset (mqtttime, 0, sizeof (mqtttime));
+         mqttprobe = 0;
+         mqttmflni = 0;
+         mqttdns = 0;
+         mqttphase = MQTTRESOLVE;
+         mqttphasestart = now;
+         if (fastbrokerip && fastbroker == revk_hash (host))
+         {                      // Address from RTC, once
+            mqttip = IPAddress (fastbrokerip);
+            mqttdns = 1;
+            fastbrokerip = 0;
+            return 0;
+         }
+         ip_addr_t ip;
+         err_t e = dns_gethostbyname (host, &ip, mqttdnsfound, (void *) (intptr_t) mqttcount);
+         if (e == ERR_OK)
+         {                      // Cached, or literal
+            mqttip = IPAddress (&ip);
+            mqttdns = 1;
+         } else if (e != ERR_INPROGRESS)
+            mqttdns = 2;
+      }
+      return 0;
+   case MQTTRESOLVE:
+      if (!mqttdns && (int) (now - mqttphasestart) < MQTTDNSWAIT)
+         return 0;              // Waiting
+      if (mqttdns != 1)
+      {
+         debugf ("MQTT DNS failed %s", host);
+         return mqttfail ();
+      }
+      mqtttime[0] = now - mqttphasestart;
+      mqttphase = (brokersha1 (mqttbroker) ? MQTTMFLN : MQTTCONNECT);
+      break;
+   case MQTTMFLN:
+      {                         // Part of connect time
+         boolean more = tlsmflnstep (host, mqttserverport, mqttmflni++);
+         mqttprobe += millis () - now;
+         if (more)
+            return 0;
+         mqttphase = MQTTCONNECT;
+      }
+      break;
+   case MQTTCONNECT:
+      {
+         boolean ok;
+         const byte *sha1 = brokersha1 (mqttbroker);
+         mqtt.setServer (mqttip, mqttserverport);
+         if (!sha1)
+         {
+            debugf ("MQTT %d insecure %s:%d", mqttbroker + 1, host, mqttserverport);
+            myclient (mqttclient);
+            mqttclient.setTimeout (MQTTCONNECTWAIT);
+            mqtt.setClient (mqttclient);
+            uint32_t heap = ESP.getFreeHeap ();
+            ok = mqttclient.connect (mqttip, mqttserverport);
+            mqttheap = heap - ESP.getFreeHeap ();
+         } else
+         {
+            debugf ("MQTT %d secure %s:%d", mqttbroker + 1, host, mqttserverport);
+            mqttmfln = myclientTLS (mqttclientsecure, sha1, host, mqttserverport);     // Already probed in MQTTMFLN
+            mqttclientsecure.setTimeout (MQTTCONNECTWAIT);
+            mqtt.setClient (mqttclientsecure);
+            uint32_t heap = ESP.getFreeHeap ();
+            ok = mqttclientsecure.connect (host, mqttserverport);       // Host for SNI, address is cached from DNS step
+            mqttheap = heap - ESP.getFreeHeap ();
+            if (ok)
+               tlsdone ();
+         }
+         if (!ok)
+         {
+            debugf ("MQTT connect failed %s", host);
+            return mqttfail ();
+         }
+         mqtttime[1] = millis () - mqttphasestart;
+         mqttphase = MQTTSESSION;
+      }
+      break;
+   case MQTTSESSION:
+      {                         // Already connected, so this is just CONNECT/CONNACK
+         char topic[TOPICMAX + 1];
+         topicmake (topic, prefixstate, false, NULL, false);
+         mqtt.setSocketTimeout (MQTTSESSIONWAIT);
+         if (!mqtt.connect (hostname, mqttuser, mqttpass, topic, MQTTQOS1, true, "0 Fail"))
+         {
+            debugf ("MQTT CONNECT failed %s %d", host, mqtt.state ());
+            return mqttfail ();
+         }
+         // Worked
+         mqtttime[2] = millis () - mqttphasestart;
+         broker_t *b = &broker[mqttbroker];
+         unsigned int t = mqtttime[0] + mqtttime[1] + mqtttime[2];
+         b->latency = (b->latency ? (b->latency * 3 + t) / 4 : t ? : 1);
+         b->fails = 0;
+         b->connects++;
+         mqttretry = 0;
+         mqttbackoff = retrymin;
+         mqttdelay = 0;
+         mqttsub = 0;
+         mqttphase = MQTTSUBSCRIBE;
+      }
+      break;
+   case MQTTSUBSCRIBE:
+      {
+         if (!mqtt.loop ())
+            return mqttfail ();
+         char topic[TOPICMAX + 1];
+         switch (mqttsub++)
+         {
+         case 0:               // Specific device
+            topicmake (topic, prefixcommand, false, "#", false);
+            break;
+         case 1:
+            topicmake (topic, prefixsetting, false, "#", false);
+            break;
+         case 2:               // All devices
+            snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/*/#"), prefixcommand, appnamelen, appname);
+            break;
+         case 3:
+            snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/*/#"), prefixsetting, appnamelen, appname);
+            mqttphase = MQTTANNOUNCE;
+            break;
+         }
+         mqtt.subscribe (topic);
+         mqtttime[3] = millis () - mqttphasestart;
+         return 0;              // Next subscribe on next step
+      }
+   case MQTTANNOUNCE:
+      mqttphase = MQTTIDLE;
+      debugf ("MQTT connected %s", host);
+      statecachecount = statecachenext = 0;     // Re-assert all state
+      unsigned long roamt = 0;
+      if (roamstart)
+      {                         // Cost of WiFi move
+         roamt = now - roamstart;
+         roamstart = 0;
+         roamcost += roamt;
+         if (roamt > roammax)
+            roammax = roamt;
+      }
+      if (mqttsilent)
+         return 1;
+      pub (true, prefixstate, NULL, F ("1 %s"), appversion);
+      pub (prefixinfo, NULL,
+           F
+           ("%S %d.%03d, flash %dKiB, W%d M%d, WiFi %s %d %02X:%02X:%02X:%02X:%02X:%02X RSSI %d Down %d.%03d, DNS %u %S %u (MFLN probe %u) MQTT %u Subscribe %u, TLS resumed %lu/%lu, MFLN %u, heap %u, first publish %lums%S"),
+           mqttbroker ? PSTR ("Backup") : PSTR ("Up"), now / 1000, now % 1000, ESP.getFlashChipRealSize () / 1024, wificount,
+           mqttcount, lastssid, lastchan, lastbssid[0], lastbssid[1], lastbssid[2], lastbssid[3], lastbssid[4], lastbssid[5],
+           WiFi.RSSI (), wifidown / 1000, wifidown % 1000, mqtttime[0], brokersha1 (mqttbroker) ? PSTR ("TLS") : PSTR ("TCP"),
+           mqtttime[1], mqttprobe, mqtttime[2], mqtttime[3], tlshit, tlshit + tlsmiss, mqttmfln, mqttheap, pubfirst,
+           fastused ? PSTR (" (RTC)") : PSTR (""));
+      if (roamt)
+         pub (prefixinfo, "roam", F ("%lu moves, last %lums (max %lums, average %lums), RSSI %d was %d"), roamcount, roamt,
+              roammax, roamcost / roamcount, WiFi.RSSI (), roamfrom);
+      if (statecache > 0)
+         pub (prefixinfo, "statecache", F ("Sent %lu, suppressed %lu"), statesent, statesuppressed);
+      for (byte n = 0; n < MQTTBROKERS; n++)
+         if (brokerscore (n, now) >= 0)
+            pub (prefixinfo, "broker", F ("%d %s%S connects %lu, failures %lu, latency %ums, score %ld"), n + 1, brokerhost (n),
+                 n == mqttbroker ? PSTR (" (in use)") : PSTR (""), broker[n].connects, broker[n].failures, broker[n].latency,
+                 brokerscore (n, now));
+      app_command ("connect", (const byte *) host, strlen ((char *) host));
+      return 1;
+   }
+   mqttphasestart = millis ();
+   return 0;
+}
+
+static boolean
+domqttopen (boolean silent = false)
+{                               // Do all of MQTT connect now
+   int r;
+   mqttstop ();
+   while (!(r = mqttstep (silent)))
+      delay (1);
+   return r > 0;
+}
+
+#define PCPY(x) ((const char*)(x))     // Default, literal is in RAM not PROGMEM, so no heap copy needed
+
+const char *localsetting (const char *tag, uint32_t hash, const byte * value, size_t len);
+
+static const byte **setref = NULL;      // Set by revk_setting_ref from app_setting/localsetting
+static boolean setrefknown = false;
+
+void
+revk_setting_ref (const void *ref)
+{                               // Where the setting just applied keeps its value (NULL if not kept), so it can be moved without telling app
+   setref = (const byte **) ref;
+   setrefknown = true;
+}
+
+static void
+settings_pack ()
+{                               // Move all values to one new buffer, and tell app/local settings where they are now
+   unsigned int size = 0,
+      i;
+   for (i = 0; i < setcount; i++)
+      if (set[i].len)
+         size += set[i].len + 1;
+   debugf ("Settings pack %d bytes, arena %d/%d, heap %d frag %d%%", size, setarenaused, setarenasize, ESP.getFreeHeap (),
+           ESP.getHeapFragmentation ());
+   byte *n = NULL;
+   if (size && !(n = (byte *) malloc (size)))
+      return;                   // Leave as is
+   byte *o = n;
+   for (i = 0; i < setcount; i++)
+   {
+      setting_t *s = set + i;
+      if (!s->len)
+         continue;
+      memcpy (o, s->value, s->len);
+      o[s->len] = 0;
+      s->value = o;
+      o += s->len + 1;
+      if (s->known)
+      {                         // Move it ourselves, not a change for the app
+         if (s->ref)
+            *s->ref = s->value;
+         continue;
+      }
+      char tag[SETTINGSTAG + 1];
+      strncpy_P (tag, s->tag, sizeof (tag) - 1);
+      tag[sizeof (tag) - 1] = 0;
+      setrefknown = false;
+      setref = NULL;
+      if (!localsetting (tag, s->hash, s->value, s->len))
+         app_setting (tag, s->value, s->len);
+      s->ref = setref;
+      s->known = setrefknown;
+   }
+   free (setpacked);
+   free (setarena);
+   setpacked = n;
+   setarena = NULL;
+   setarenasize = setarenaused = 0;
+   debugf ("Settings packed, heap %d frag %d%%", ESP.getFreeHeap (), ESP.getHeapFragmentation ());
+}
+
+static byte *
+settings_alloc (unsigned int len)
+{                               // Space for a new value in arena, only used (settings_used) if value kept
+   if (setarena && setarenaused + len > setarenasize)
+      settings_pack ();         // Full
+   if (!setarena && (setarena = (byte *) malloc (SETTINGSARENA)))
+   {
+      setarenasize = SETTINGSARENA;
+      setarenaused = 0;
+   }
+   if (!setarena || setarenaused + len > setarenasize)
+      return NULL;
+   return setarena + setarenaused;
+}
+
+#define	settings_used(l)	(setarenaused+=(l))
 
 void
 settings_reset ()
 {                               // Invalidate settings
-   EEPROM.begin (MAXEEPROM);
-   EEPROM.write (0, 0);
-   EEPROM.end ();
+   byte slot;
+   for (slot = 0; slot < SETTINGSSLOTS; slot++)
+   {
+      ESP.flashEraseSector (SETTINGSSECTOR (slot));
+      settingserase++;
+   }
+   settingstail = 0;
+}
+
+static uint32_t
+settings_crc (const byte * p, unsigned int len)
+{                               // CRC32
+   uint32_t crc = 0xFFFFFFFF;
+   while (len--)
+   {
+      crc ^= *p++;
+      for (int b = 0; b < 8; b++)
+         crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+   }
+   return ~crc;
+}
+
+static unsigned int
+settings_record (uint32_t * rec, const char *tag, const byte * value, byte len)
+{                               // Build a log record (tag is PROGMEM), return padded length, 0 if cannot
+   unsigned int l = strlen_P (tag);
+   if (!l || l > SETTINGSTAG)
+      return 0;
+   unsigned int reclen = settingsrec (l, len);
+   rec[reclen / 4 - 1] = 0xFFFFFFFF;    // Padding
+   byte *r = (byte *) rec;
+   r[4] = l;
+   r[5] = len;
+   memcpy_P (r + 6, tag, l);
+   if (len)
+      memcpy (r + 6 + l, value, len);
+   rec[0] = settings_crc (r + 4, 2 + l + len);
+   return reclen;
+}
+
+static unsigned int
+settings_headok (const uint32_t * head, uint32_t * seq)
+{                               // Check header, return its length, or 0 if not valid
+   const byte *b = (const byte *) head;
+   if (memcmp (b, settingssig, sizeof (settingssig) - 1) || head[1] != settings_crc (b + 8, 5 + b[12]))
+      return 0;
+   *seq = head[2];
+   return settingshead (b[12]);
+}
+
+static int
+settings_pick (uint32_t * head)
+{                               // Read slot headers, return latest valid slot, with its header in head, or -1 if none
+   uint32_t seq0,
+     seq1;
+   boolean ok0 = (ESP.flashRead (SETTINGSSECTOR (0) * SPI_FLASH_SEC_SIZE, head, SETTINGSHEAD) && settings_headok (head, &seq0));
+   boolean ok1 = (SETTINGSSLOTS > 1 && ESP.flashRead (SETTINGSSECTOR (1) * SPI_FLASH_SEC_SIZE, head, SETTINGSHEAD)
+                  && settings_headok (head, &seq1));
+   if (ok1 && (!ok0 || (int32_t) (seq1 - seq0) > 0))
+      return 1;
+   if (ok0 && ESP.flashRead (SETTINGSSECTOR (0) * SPI_FLASH_SEC_SIZE, head, SETTINGSHEAD))
+      return 0;
+   return -1;
+}
+
+static boolean
+settings_write (byte slot, unsigned int addr, uint32_t * rec, unsigned int reclen)
+{                               // Write to settings log and check it took
+   uint32_t check[SETTINGSREC / 4];
+   uint32_t base = SETTINGSSECTOR (slot) * SPI_FLASH_SEC_SIZE + addr;
+   if (!ESP.flashWrite (base, rec, reclen) || !ESP.flashRead (base, check, reclen) || memcmp (check, rec, reclen))
+   {
+      debugf ("Settings write failed at %d/%d", slot, addr);
+      return false;
+   }
+   return true;
+}
+
+static boolean
+settings_compact ()
+{                               // Write all current settings as a new log in the other slot (or in place if one slot), header last
+   uint32_t rec[SETTINGSREC / 4];   // Also used for header, which is smaller
+   byte slot = (SETTINGSSLOTS > 1 ? 1 - settingsslot : 0);
+   ESP.flashEraseSector (SETTINGSSECTOR (slot));
+   settingserase++;
+   unsigned int addr = settingshead (appnamelen);
+   setting_t *s;
+   for (s = set; s < set + setcount; s++)
+   {
+      if (!s->len)
+         continue;              // Deleted
+      unsigned int reclen = settings_record (rec, s->tag, s->value, s->len);
+      if (!reclen)
+      {
+         debugf ("Cannot save %S as bad length (%d)", s->tag, s->len);
+         continue;              // Cannot save
+      }
+      if (addr + reclen > SPI_FLASH_SEC_SIZE || !settings_write (slot, addr, rec, reclen))
+         return false;
+      addr += reclen;
+   }
+   {                            // Header, makes this slot the latest
+      byte *r = (byte *) rec;
+      unsigned int headlen = settingshead (appnamelen);
+      rec[headlen / 4 - 1] = 0xFFFFFFFF;
+      memcpy (r, settingssig, sizeof (settingssig) - 1);
+      rec[2] = settingsseq + 1;
+      r[12] = appnamelen;
+      memcpy (r + 13, appname, appnamelen);
+      rec[1] = settings_crc (r + 8, 5 + appnamelen);
+      if (!settings_write (slot, 0, rec, headlen))
+         return false;
+   }
+   settingsslot = slot;
+   settingsseq++;
+   settingstail = addr;
+   debugf ("Settings compacted to %d seq %d, used %d/%d bytes, erase %d", slot, settingsseq, addr, SPI_FLASH_SEC_SIZE,
+           settingserase);
+   return true;
 }
 
 boolean
 settings_save ()
-{
+{                               // Append changed settings to log, compacting only if log full
    if (!settingsupdate)
       return true;              // OK(not saved)
    if (!appnamelen)
       return false;             // No app name, minimal load to load app
-   EEPROM.begin (MAXEEPROM);
-   unsigned int addr = 0,
-      i,
-      l;
-   EEPROM.write (addr++, 0);
-   for (i = 0; i < sizeof (eepromsig) - 1; i++)
-      EEPROM.write (addr++, eepromsig[i]);
-   EEPROM.write (addr++, appnamelen);
-   for (i = 0; i < appnamelen; i++)
-      EEPROM.write (addr++, appname[i]);
+   uint32_t rec[SETTINGSREC / 4];
    setting_t *s;
-   for (s = set; s; s = s->next)
+   for (s = set; s < set + setcount && settingstail; s++)
    {
-      l = strlen_P (s->tag);
-      char temp[50];
-      if (!l || l > sizeof (temp) - 1 || s->len > 255)
+      if (!s->dirty)
+         continue;
+      unsigned int reclen = settings_record (rec, s->tag, s->value, s->len);
+      if (!reclen)
       {
          debugf ("Cannot save %S as bad length (%d)", s->tag, s->len);
          continue;              // Cannot save
       }
-      strcpy_P (temp, s->tag);
-      EEPROM.write (addr++, l);
-      for (i = 0; i < l; i++)
-         EEPROM.write (addr++, temp[i]);
-      EEPROM.write (addr++, s->len);
-      for (i = 0; i < s->len; i++)
-         EEPROM.write (addr++, ((char *) s->value)[i]);
-   }
-   EEPROM.write (addr++, 0);    // End of settings
-   EEPROM.write (0, sizeof (eepromsig) - 1);    // Make settings valid
-   debugf ("Settings saved, used %d/%d bytes", addr, MAXEEPROM);
-   EEPROM.end ();
+      if (settingstail + reclen > SPI_FLASH_SEC_SIZE || !settings_write (settingsslot, settingstail, rec, reclen))
+         settingstail = 0;      // Full (or bad), compact
+      else
+         settingstail += reclen;
+   }
+   if (!settingstail && !settings_compact ())
+      return false;             // Leave settingsupdate set, try again later
+   debugf ("Settings saved, used %d/%d bytes", settingstail, SPI_FLASH_SEC_SIZE);
+   unsigned int i,
+     o = 0;
+   for (i = 0; i < setcount; i++)
+      if (set[i].len)
+      {
+         set[i].dirty = false;
+         set[o++] = set[i];
+      }                         // Else deleted, now recorded
+   setcount = o;
    settingsupdate = 0;
    return true;                 // Done
 }
 
+static boolean
+settings_appname (const byte * b, unsigned int l)
+{                               // Check app name in loaded header
+   if (!appnamelen)
+      return true;              // Minimal
+   return l == appnamelen && !memcmp (b, appname, l);
+}
+
 boolean
 loadsettings ()
 {
    debug ("Load settings");
+   settingsupdate = (millis ()? : 1);   // Save settings, unless loaded cleanly
+   uint32_t *buf = (uint32_t *) malloc (SPI_FLASH_SEC_SIZE);
+   if (!buf)
+   {
+      debug ("Settings not read");
+      return false;
+   }
+   const byte *b = (const byte *) buf;
    unsigned int addr = 0,
       i,
       l;
-   EEPROM.begin (MAXEEPROM);
-   i = 0;
-   l = EEPROM.read (addr++);
-   if (l == sizeof (eepromsig) - 1)
-      for (i = 0; i < sizeof (eepromsig) - 1 && EEPROM.read (addr++) == eepromsig[i]; i++);
-   if (!i || i != sizeof (eepromsig) - 1)
-   {
-      settingsupdate = (millis ()? : 1);        // Save settings
-      debug ("EEPROM not set");
-      EEPROM.end ();
-      return false;             // Check app name
-   }
-   i = 0;
-   l = EEPROM.read (addr++);
-   if (!appnamelen)
-      addr += l;                // Skip
-   else
+   char name[SETTINGSTAG + 1];
+   boolean bad = false;
+   int slot = settings_pick (buf);
+   if (slot >= 0 && ESP.flashRead (SETTINGSSECTOR (slot) * SPI_FLASH_SEC_SIZE, buf, SPI_FLASH_SEC_SIZE))
    {
-      if (l == appnamelen)
-         for (i = 0; i < appnamelen && EEPROM.read (addr++) == appname[i]; i++);
-      if (!i || i != appnamelen)
+      addr = settings_headok (buf, &settingsseq);
+      settingsslot = slot;
+      if (!settings_appname (b + 13, b[12]))
       {
-         if (appnamelen)
-            settingsupdate = (millis ()? : 1);  // Save settings
-         debug ("EEPROM different app");
-         EEPROM.end ();
-         return false;          // Check app name
+         free (buf);
+         debug ("Settings different app");
+         return false;
       }
-   }
-   char name[33];
-   byte value[257];
-   boolean bad = false;
-   while (1)
-   {
-      l = EEPROM.read (addr++);
-      if (!l)
-         break;
-      if (l >= sizeof (name))
-      {                         // Bad name, skip
-         debugf ("Bad name len to read (%d)", l);
+      setarena = (byte *) buf;  // Values moved down buffer as read
+      setarenasize = SPI_FLASH_SEC_SIZE;
+      setarenaused = 0;
+      // Records, stop at erased or bad CRC
+      while (addr + 6 <= SPI_FLASH_SEC_SIZE && b[addr + 4] != 0xFF)
+      {
+         l = b[addr + 4];
+         i = b[addr + 5];
+         if (!l || l > SETTINGSTAG || addr + settingsrec (l, i) > SPI_FLASH_SEC_SIZE
+             || buf[addr / 4] != settings_crc (b + addr + 4, 2 + l + i))
+         {
+            debugf ("Bad settings record at %d/%d", slot, addr);
+            break;
+         }
+         memcpy (name, b + addr + 6, l);
+         name[l] = 0;
+         if (!setting_apply (name, b + addr + 6 + l, i) && appnamelen)
+            bad = true;
+         addr += settingsrec (l, i);
+      }
+      settingstail = addr;
+      for (i = addr; i < SPI_FLASH_SEC_SIZE && b[i] == 0xFF; i++);
+      if (bad || i < SPI_FLASH_SEC_SIZE)
+         settingstail = 0;      // Junk after log (e.g. interrupted write), or settings to drop, so compact
+   } else if (ESP.flashRead (SETTINGSSECTOR (0) * SPI_FLASH_SEC_SIZE, buf, SPI_FLASH_SEC_SIZE)
+              && b[0] == sizeof (eepromsig) - 1 && !memcmp (b + 1, eepromsig, sizeof (eepromsig) - 1))
+   {                            // Old EEPROM format [0x04]RevK[applen][app]{[taglen][tag][len][value]}...[0], load and compact
+      addr = sizeof (eepromsig);
+      l = b[addr++];
+      if (!settings_appname (b + addr, l))
+      {
+         free (buf);
+         debug ("Settings different app");
+         return false;
+      }
+      addr += l;
+      setarena = (byte *) buf;  // Values moved down buffer as read
+      setarenasize = SPI_FLASH_SEC_SIZE;
+      setarenaused = 0;
+      while (addr < SPI_FLASH_SEC_SIZE && (l = b[addr++]))
+      {
+         if (l > SETTINGSTAG || addr + l >= SPI_FLASH_SEC_SIZE || addr + l + 1 + b[addr + l] > SPI_FLASH_SEC_SIZE)
+         {                      // Bad name, skip
+            debugf ("Bad name len to read (%d)", l);
+            addr += l;
+            if (addr < SPI_FLASH_SEC_SIZE)
+               addr += 1 + b[addr];
+            continue;
+         }
+         memcpy (name, b + addr, l);
+         name[l] = 0;
          addr += l;
-         //Skip name
-         l = EEPROM.read (addr++);
+         l = b[addr++];
+         setting_apply (name, b + addr, l);
          addr += l;
-         //Skip value
-         continue;
       }
-      for (i = 0; i < l; i++)
-         name[i] = EEPROM.read (addr++);
-      name[i] = 0;
-      l = EEPROM.read (addr++);
-      for (i = 0; i < l; i++)
-         value[i] = EEPROM.read (addr++);
-      value[i] = 0;
-      if (!setting_apply (name, value, l) && appnamelen)
-         bad = true;
-   }
-   EEPROM.end ();
-   if (!bad)
+      settingsslot = 0;
+      settingstail = 0;
+   } else
+   {
+      free (buf);
+      debug ("Settings not set");
+      return false;
+   }
+   settings_pack ();            // Frees buf
+   for (i = 0; i < setcount; i++)
+      set[i].dirty = false;     // As stored
+   if (settingstail)
       settingsupdate = 0;       // No need to save
    do_restart = 0;              // Not changed key settings
-   debug ("Loaded settings");
+   debugf ("Loaded settings %d seq %d", settingsslot, settingsseq);
    return true;
 }
 
-static int
-doupdate (char *url)
-{
-   debugf ("Do update %s", url);
-   int ret = 0;
-   if (mqtt.connected ())
+// OTA is streamed in steps, the SHA-256 from the manifest (if served) checked before the image is committed
+// The manifest is base.sha256 in sha256sum format, a line for each variant served, fetched once for all variants
+// A variant not listed is not fetched, as it is not on the server, no manifest means all variants are tried unchecked
+// A dropped connection resumes with an HTTP Range request, only giving up after OTATRIES with no progress
+// The last chunk is held back until the hash is checked, so a bad image is never marked as complete
+#define	OTAIDLE		0
+#define	OTAMANIFEST	1       // Get base.sha256, once, then pick hash for variant
+#define	OTACONNECT	2       // Request image (from otadone)
+#define	OTADATA		3       // Reading image
+#define	OTAVERIFY	4       // Check hash, write last chunk, end
+#define	OTADONE		5
+#define	OTAFAIL		6
+#define	OTAMQTT		7       // Receiving chunks over MQTT
+#define	OTACHUNK	512     // Bytes read at a time
+#define	OTATRIES	5       // Connects without progress before giving up
+#define	OTATIMEOUT	10000   // ms with no data before reconnecting
+#define	OTAHEAP		24000   // Free heap needed to keep MQTT up during OTA
+#define	OTABUDGET	20      // ms of OTA steps per loop, app and MQTT run in between
+#define	OTAMQTTCHUNK	1024    // Max data per otachunk message
+#define	OTAMQTTWINDOW	4       // Chunks the sender may have unacknowledged
+#define	OTAMQTTTIMEOUT	60000   // ms with no chunk before giving up
+static byte otaphase = OTAIDLE;
+static const char *otaurl = NULL;
+static const char *otafail = NULL;      // PROGMEM reason for OTAFAIL
+static boolean otanospace = false;      // Failed as image too big
+static boolean otamissing = false;      // Failed as image not on server
+static boolean otahavesha = false;      // Have SHA-256 from manifest
+static byte otasha[32];
+static br_sha256_context otactx;
+static size_t otasize = 0;      // Image size
+static size_t otadone = 0;      // Bytes received and hashed
+static size_t otaskip = 0;      // Bytes to discard (server ignored Range)
+static byte otatries = 0;
+static byte otapercent = 0;     // Last reported
+static unsigned long otastart = 0;
+static unsigned long otalast = 0;       // Last data
+static byte *otatail = NULL;    // Last chunk, held back
+static size_t otataillen = 0;
+static WiFiClientSecure *otaclient = NULL;
+static HTTPClient *otahttp = NULL;
+static char otabase[160];       // URL of full image
+static char otaurlbuf[200];     // URL being fetched (variant of otabase)
+static byte otavariant = 0;     // Next variant of otabase to try
+static byte otamanifest = 0;    // Manifest for otabase, 0 not fetched, 1 fetched, 2 not served
+static byte otashaset = 0;      // Variants listed in manifest
+static byte otashas[3][32];     // SHA-256 of each variant from manifest
+static boolean otaminimal = false;      // Trying Minimal image
+static boolean otaheld = false; // App is holding back reboot
+static boolean otamqttclosed = false;   // MQTT closed for lack of heap, stays closed until OTA done
+static uint32_t otamseq = 0;    // Next chunk expected over MQTT
+static uint32_t otamnack = 0;   // Chunk last asked for again (so once per gap)
+static uint16_t otamqttbuf = 0; // MQTT buffer size before OTA over MQTT
+// A delta is a patch against the running image (flash from 0 for ESP.getSketchSize, as ESP.getSketchMD5)
+// Header is "RDP1", MD5 of old image, MD5 of new image, new size, then records of :-
+// 'C' offset len       Copy len bytes from old image at offset
+// 'I' len data         Insert len bytes of data
+// Numbers are 32 bits little endian, records are applied in order so the new image is written sequentially
+// extras/otadelta.cpp makes these, and checks them by applying them in the same way
+#define	OTAPATCHHEAD	40
+static boolean otadelta = false;        // Data is a patch, not an image
+static byte otapatch[OTAPATCHHEAD];     // Header, or record being received
+static byte otapatchlen = 0;    // Bytes in otapatch
+static uint32_t otainsert = 0;  // Bytes of data still to insert
+
+static void
+otaclose ()
+{                               // Close OTA connection
+   if (otahttp)
    {
-      pub (true, prefixstate, NULL, F ("0 OTA https://%s%s"), otahost, url);
-      mqtt.disconnect ();
-      delay (100);
-      mqttclientsecure.stop ();
+      otahttp->end ();
+      delete otahttp;
+      otahttp = NULL;
    }
-   debugf ("OTA https://%s%s", otahost, url);
-   int ok = 0;
-   if (otasha1)
-   {
-      WiFiClientSecure client;
-      myclientTLS (client, otasha1);
-      ok = ESPhttpUpdate.update (client, String (otahost), 443, String (url));
-   } else
+   if (otaclient)
    {
-      WiFiClientSecure client;
-      myclientTLS (client);
-      ok = ESPhttpUpdate.update (client, String (otahost), 443, String (url));
+      delete otaclient;
+      otaclient = NULL;
    }
-   debugf ("OTA done %s", ESPhttpUpdate.getLastErrorString ().c_str ());
-   if (domqttopen (true))
+   tlssave ();
+}
+
+static boolean
+otamore ()
+{                               // If there is another variant of otabase to try
+   for (byte v = otavariant; v < 3; v++)
+      if (otamanifest != 1 || (otashaset & (1 << v)))
+         return true;
+   return false;
+}
+
+static void
+otaend (const char *reason)
+{                               // Fail (PROGMEM reason)
+   debugf ("OTA fail %S", reason);
+   otaclose ();
+   if (Update.isRunning ())
+      Update.end ();            // Not complete, so not committed
+   free (otatail);
+   otatail = NULL;
+   otafail = reason;
+   otaphase = OTAFAIL;
+   if (otamissing && otamore ())
+      return;                   // Expected, another variant is tried next, only reported once all are missing
+   pub (prefixerror, "ota", F ("%S %u/%u"), reason, otadone, otasize);
+}
+
+static uint32_t
+le32 (const byte * p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static const char *
+otacopy (uint32_t from, uint32_t len)
+{                               // Copy from running image to update, returns PROGMEM error or NULL
+   uint32_t buf[64];
+   if (from + len < from || from + len > ESP.getSketchSize ())
+      return PSTR ("Bad copy");
+   while (len)
+   {
+      uint32_t a = (from & ~3),
+         o = from - a,
+         n = sizeof (buf) - o;
+      if (n > len)
+         n = len;
+      if (!ESP.flashRead (a, buf, (o + n + 3) & ~3) || Update.write ((byte *) buf + o, n) != n)
+         return PSTR ("Write failed");
+      from += n;
+      len -= n;
+   }
+   return NULL;
+}
+
+static const char *
+otawrite (byte * p, size_t l)
+{                               // Write received data to update, applying it as a patch if delta, returns PROGMEM error or NULL
+   if (!otadelta)
+      return Update.write (p, l) == l ? NULL : PSTR ("Write failed");
+   while (l)
    {
-      if (ok)
-         pub (true, prefixstate, NULL, F ("0 OTA Reboot"));
+      if (otainsert)
+      {
+         size_t n = (l < otainsert ? l : otainsert);
+         if (Update.write (p, n) != n)
+            return PSTR ("Write failed");
+         p += n;
+         l -= n;
+         otainsert -= n;
+         continue;
+      }
+      otapatch[otapatchlen++] = *p++;
+      l--;
+      if (!Update.isRunning ())
+      {                         // Header
+         if (otapatchlen < OTAPATCHHEAD)
+            continue;
+         if (memcmp_P (otapatch, PSTR ("RDP1"), 4))
+            return PSTR ("Bad delta");
+         char hex[33];
+         int i;
+         for (i = 0; i < 16; i++)
+            sprintf_P (hex + i * 2, PSTR ("%02x"), otapatch[4 + i]);
+         if (strcasecmp (hex, ESP.getSketchMD5 ().c_str ()))
+         {                      // Not for the image we are running
+            otamissing = true;
+            return PSTR ("Delta mismatch");
+         }
+         if (!Update.begin (le32 (otapatch + 36)))
+         {
+            otanospace = true;
+            return PSTR ("No space");
+         }
+         for (i = 0; i < 16; i++)
+            sprintf_P (hex + i * 2, PSTR ("%02x"), otapatch[20 + i]);
+         Update.setMD5 (hex);   // Checked by Update.end()
+      } else if (otapatch[0] == 'C')
+      {
+         if (otapatchlen < 9)
+            continue;
+         const char *e = otacopy (le32 (otapatch + 1), le32 (otapatch + 5));
+         if (e)
+            return e;
+      } else if (otapatch[0] == 'I')
+      {
+         if (otapatchlen < 5)
+            continue;
+         otainsert = le32 (otapatch + 1);
+      } else
+         return PSTR ("Bad delta");
+      otapatchlen = 0;
+   }
+   return NULL;
+}
+
+static boolean
+otahex (const char *h, byte * sha)
+{                               // Set sha from 64 hex digits
+   int i;
+   for (i = 0; i < 64 && isxdigit (h[i]); i++)
+   {
+      byte v = (isdigit (h[i]) ? h[i] - '0' : (h[i] | 0x20) - 'a' + 10);
+      if (i & 1)
+         sha[i / 2] |= v;
       else
-         pub (true, prefixstate, NULL, F ("0 OTA Error %s"), ESPhttpUpdate.getLastErrorString ().c_str ());
+         sha[i / 2] = (v << 4);
+   }
+   return i == 64 && !isxdigit (h[i]);
+}
+
+static boolean
+otavarianturl (byte v, char *url, size_t len)
+{                               // Make URL of variant of otabase, url.<md5>.delta (patch of running image), url.gz (gzip image, inflated by eboot on reboot), then url
+   size_t l = strlen (otabase);
+   if (v == 0)
+   {
+      String md5 = ESP.getSketchMD5 ();
+      if (!md5.length () || l + md5.length () + 7 >= len)
+         return false;
+      snprintf_P (url, len, PSTR ("%s.%s.delta"), otabase, md5.c_str ());
+   } else if (v == 1)
+   {
+      if (l + 3 >= len)
+         return false;
+      snprintf_P (url, len, PSTR ("%s.gz"), otabase);
+   } else
+      strcpy (url, otabase);
+   return true;
+}
+
+static boolean
+otamanifestparse (const char *m)
+{                               // Parse sha256sum format manifest, hash then file name, for each variant, false if none
+   char *url = (char *) malloc (sizeof (otaurlbuf));
+   if (!url)
+      return false;
+   otashaset = 0;
+   while (*m)
+   {
+      byte sha[32];
+      if (otahex (m, sha))
+      {
+         const char *n = m + 64,
+            *e;
+         while (*n == ' ' || *n == '\t' || *n == '*')
+            n++;                // Binary mode marker
+         for (e = n; *e && *e != '\r' && *e != '\n'; e++);
+         for (byte v = 0; v < 3; v++)
+            if (otavarianturl (v, url, sizeof (otaurlbuf)))
+            {
+               const char *b = strrchr (url, '/');
+               b = (b ? b + 1 : url);
+               if (e == n ? v == 2 : (strlen (b) == e - n && !memcmp (b, n, e - n)))
+               {                // Same file name, or plain image if just a hash
+                  memcpy (otashas[v], sha, sizeof (sha));
+                  otashaset |= (1 << v);
+               }
+            }
+      }
+      while (*m && *m != '\n')
+         m++;
+      if (*m)
+         m++;
+   }
+   free (url);
+   return otashaset;
+}
+
+static int
+otaget (const char *url, size_t from)
+{                               // Start request, returns HTTP code
+   otaclose ();
+   otaclient = new WiFiClientSecure;
+   otahttp = new HTTPClient;
+   if (!otaclient || !otahttp)
+      return -1;
+   myclientTLS (*otaclient, otasha1, otahost, 443);
+   otahttp->setTimeout (OTATIMEOUT);
+   if (!otahttp->begin (*otaclient, otahost, 443, url, true))
+      return -1;
+   if (from)
+   {
+      char range[24];
+      snprintf_P (range, sizeof (range), PSTR ("bytes=%u-"), from);
+      otahttp->addHeader (F ("Range"), range);
+   }
+   static const char *keys[] = { "Content-Range" };
+   otahttp->collectHeaders (keys, 1);
+   int code = otahttp->GET ();
+   if (code > 0)
+      tlsdone ();               // Connected, so session stats cover OTA as well as MQTT
+   return code;
+}
+
+static boolean
+otabegin (const char *url, boolean delta = false)
+{                               // Start OTA
+   if (otaphase != OTAIDLE && otaphase != OTADONE && otaphase != OTAFAIL)
+      return false;
+   otaurl = url;
+   otadelta = delta;
+   otapatchlen = 0;
+   otainsert = 0;
+   otafail = NULL;
+   otanospace = false;
+   otamissing = false;
+   otahavesha = false;
+   otasize = otadone = otaskip = 0;
+   otatries = otapercent = 0;
+   otastart = otalast = (millis ()? : 1);
+   br_sha256_init (&otactx);
+   otaphase = OTAMANIFEST;
+   debugf ("OTA https://%s%s", otahost, url);
+   return true;
+}
+
+static void
+otaprogress (boolean final)
+{                               // Report progress and throughput as info
+   byte p = (otasize ? (uint64_t) otadone * 100 / otasize : 0);
+   if (!final && p / 10 == otapercent / 10)
+      return;
+   otapercent = p;
+   unsigned long t = millis () - otastart;
+   pub (prefixinfo, "ota", F ("%u/%u %u%% %luB/s"), otadone, otasize, p,
+        (unsigned long) ((uint64_t) otadone * 1000 / (t ? : 1)));
+}
+
+static int
+otastep ()
+{                               // Do one step of OTA, returns 0 if more to do, 1 if done, -1 if failed
+   switch (otaphase)
+   {
+   case OTAIDLE:
+      return -1;
+   case OTAMANIFEST:
+      if (!otamanifest)
+      {                         // Once for all variants
+         char *url = (char *) malloc (strlen (otabase) + 8);
+         if (!url)
+         {
+            otaend (PSTR ("No memory"));
+            break;
+         }
+         strcpy (url, otabase);
+         strcat_P (url, PSTR (".sha256"));
+         int code = otaget (url, 0);
+         free (url);
+         if (code == 200)
+         {
+            String m = otahttp->getString ();
+            if (!otamanifestparse (m.c_str ()))
+            {
+               otaend (PSTR ("Bad manifest"));
+               break;
+            }
+            otamanifest = 1;
+         } else if (code == 404)
+            otamanifest = 2;    // No manifest is allowed
+         else
+         {                      // Anything else is a problem
+            if (++otatries >= OTATRIES)
+               otaend (PSTR ("No manifest"));
+            break;
+         }
+         debugf ("OTA manifest %d", code);
+      }
+      if (otamanifest == 1)
+      {                         // Hash for this variant (otanext has moved on to the next)
+         byte v = otavariant - 1;
+         if (v >= 3 || !(otashaset & (1 << v)))
+         {
+            otamissing = true;
+            otaend (PSTR ("Not found"));
+            break;
+         }
+         memcpy (otasha, otashas[v], sizeof (otasha));
+         otahavesha = true;
+      }
+      otatries = 0;
+      otaphase = OTACONNECT;
+      break;
+   case OTACONNECT:
+      {
+         if (otatries++ >= OTATRIES)
+         {
+            otaend (PSTR ("Too many tries"));
+            break;
+         }
+         int code = otaget (otaurl, otadone);
+         if (!otadone && code == 200)
+         {
+            int size = otahttp->getSize ();
+            if (size <= 0)
+            {
+               otaend (PSTR ("No size"));
+               break;
+            }
+            otasize = size;
+            if (!otadelta && !Update.begin (otasize))
+            {
+               otanospace = true;
+               otaend (PSTR ("No space"));
+               break;
+            }
+         } else if (otadone && code == 200)
+         {                      // Server ignored range, so discard what we have
+            if ((size_t) otahttp->getSize () != otasize)
+            {
+               otaend (PSTR ("Changed"));
+               break;
+            }
+            otaskip = otadone;
+         } else if (otadone && code == 206)
+         {                      // Content-Range: bytes a-b/size
+            String r = otahttp->header ("Content-Range");
+            const char *c = r.c_str ();
+            while (*c && !isdigit (*c))
+               c++;
+            size_t from = strtoul (c, NULL, 10);
+            c = strchr (c, '/');
+            if (!c || strtoul (c + 1, NULL, 10) != otasize || from > otadone)
+            {
+               otaend (PSTR ("Changed"));
+               break;
+            }
+            otaskip = otadone - from;
+         } else if (!otadone && code == 404)
+         {
+            otamissing = true;
+            otaend (PSTR ("Not found"));
+            break;
+         } else
+         {
+            debugf ("OTA HTTP %d", code);
+            otaclose ();
+            break;              // Try again
+         }
+         debugf ("OTA from %u/%u", otadone, otasize);
+         otalast = (millis ()? : 1);
+         otaphase = OTADATA;
+      }
+      break;
+   case OTADATA:
+      {
+         WiFiClient *s = otahttp->getStreamPtr ();
+         byte buf[OTACHUNK];
+         int a = (s ? s->available () : 0);
+         if (a <= 0)
+         {
+            if (!s || !s->connected () || (int) (millis () - otalast) > OTATIMEOUT)
+            {                   // Resume
+               debugf ("OTA dropped at %u/%u", otadone, otasize);
+               otaclose ();
+               otaphase = OTACONNECT;
+            }
+            break;
+         }
+         size_t n = (size_t) a;
+         if (n > sizeof (buf))
+            n = sizeof (buf);
+         if (otaskip)
+         {
+            if (n > otaskip)
+               n = otaskip;
+            otaskip -= s->read (buf, n);
+            break;
+         }
+         if (n > otasize - otadone)
+            n = otasize - otadone;
+         int l = s->read (buf, n);
+         if (l <= 0)
+            break;
+         otalast = (millis ()? : 1);
+         otatries = 0;
+         br_sha256_update (&otactx, buf, l);
+         otadone += l;
+         if (otadone == otasize)
+         {                      // Last chunk
+            otatail = (byte *) malloc (l);
+            if (!otatail)
+            {
+               otaend (PSTR ("No memory"));
+               break;
+            }
+            memcpy (otatail, buf, l);
+            otataillen = l;
+            otaclose ();
+            otaphase = OTAVERIFY;
+            break;
+         }
+         const char *e = otawrite (buf, l);
+         if (e)
+         {
+            otaend (e);
+            break;
+         }
+         otaprogress (false);
+      }
+      break;
+   case OTAVERIFY:
+      {
+         byte sha[32];
+         br_sha256_out (&otactx, sha);
+         if (otahavesha && memcmp (sha, otasha, sizeof (sha)))
+         {
+            otaend (PSTR ("SHA-256 mismatch"));
+            break;
+         }
+         const char *e = otawrite (otatail, otataillen);
+         free (otatail);
+         otatail = NULL;
+         if (e || otainsert || otapatchlen || !Update.end ())
+         {
+            otaend (e ? : PSTR ("Update failed"));
+            break;
+         }
+         otaprogress (true);
+         debug ("OTA done");
+         otaphase = OTADONE;
+      }
+      break;
+   }
+   if (otaphase == OTADONE)
+      return 1;
+   if (otaphase == OTAFAIL)
+      return -1;
+   return 0;
+}
+
+static boolean
+otanext ()
+{                               // Start next variant of otabase
+   if (!otavariant)
+      otamanifest = 0;          // New otabase
+   while (otavariant < 3)
+   {
+      byte v = otavariant++;
+      char *url = otaurlbuf;
+      if (!otavarianturl (v, url, sizeof (otaurlbuf)))
+         continue;
+      if (otamanifest == 1 && !(otashaset & (1 << v)))
+         continue;              // Not on server
+      debugf ("Do update %s", url);
+      if (mqtt.connected ())
+      {
+         pub (true, prefixstate, NULL, F ("0 OTA https://%s%s"), otahost, url);
+         if (ESP.getFreeHeap () < OTAHEAP)
+         {                      // Not enough for two TLS connections, so MQTT stays down until OTA is done
+            mqtt.disconnect ();
+            delay (100);
+            mqttclientsecure.stop ();
+            otamqttclosed = true;
+         }
+      }
+      return otabegin (url, !v);
+   }
+   return false;
+}
+
+static void
+otareboot ()
+{                               // Reboot in to new image
+   debug ("OTA reboot");
+   app_command ("restart", NULL, 0);
+   settings_save ();
+   tlssave ();
+   fastsave ();
+   if (mqtt.connected ())
+   {
+      pub (true, prefixstate, NULL, F ("0 OTA Reboot"));
+      mqtt.disconnect ();
+      delay (100);
    }
-   return ok ? 0 : ESPhttpUpdate.getLastError ();
+   WiFi.disconnect ();
+   delay (100);
+   ESP.restart ();              // Boot
+   ESP.reset ();                // Boot hard (?)
+}
+
+// OTA over MQTT, for when otahost cannot be reached, is started by command otamqtt with size, SHA-256 (hex), and optional "delta"
+// Sender sends command otachunk with sequence (from 0) and CRC32 of data (32 bits little endian), then up to OTAMQTTCHUNK bytes
+// Device replies info/otaack with next sequence wanted, after each OTAMQTTWINDOW/2 chunks, and once on a gap or bad CRC
+// The sender keeps up to OTAMQTTWINDOW chunks unacknowledged, and goes back to the sequence in an otaack
+// A delta that is not for the running image is an error, the sender has to send the full image (no HTTP fallback)
+// Chunks are not queued as commands, they are written as they arrive, the last held back until checked as for HTTP
+static boolean
+command_otamqtt (const char *tag, const byte * message, size_t len)
+{                               // Start OTA over MQTT
+   char temp[80];
+   if (!len || len >= sizeof (temp) || (otaphase != OTAIDLE && otaphase != OTAFAIL))
+      return false;
+   memcpy (temp, message, len);
+   temp[len] = 0;
+   char *p;
+   unsigned long size = strtoul (temp, &p, 10);
+   while (*p == ' ')
+      p++;
+   if (!size || !otahex (p, otasha))
+      return false;
+   p += 64;
+   while (*p == ' ')
+      p++;
+   boolean delta = !strcasecmp_P (p, PSTR ("delta"));
+   otabegin (PSTR ("MQTT"), delta);
+   otahavesha = true;           // Always checked
+   otasize = size;
+   otavariant = 3;              // No HTTP variants to try if delta does not match, the sender has to send the image
+   otaminimal = true;           // No Minimal fallback
+   if (!delta && !Update.begin (otasize))
+   {
+      otanospace = true;
+      otaend (PSTR ("No space"));
+      return true;
+   }
+   if (mqtt.getBufferSize () < OTAMQTTCHUNK + 256)
+   {                            // Chunk, header, and topic, normally already fits MQTTBUFFER
+      otamqttbuf = mqtt.getBufferSize ();
+      if (!mqtt.setBufferSize (OTAMQTTCHUNK + 256))
+      {
+         otamqttbuf = 0;
+         otaend (PSTR ("No memory"));
+         return true;
+      }
+   }
+   otamseq = 0;
+   otamnack = ~0;
+   otaphase = OTAMQTT;
+   pub (true, prefixstate, NULL, F ("0 OTA MQTT"));
+   pub (prefixinfo, "otaack", F ("%lu %u %u"), 0UL, OTAMQTTWINDOW, OTAMQTTCHUNK);
+   return true;
+}
+
+static void
+otachunk (byte * p, size_t len)
+{                               // Chunk received over MQTT (called from mqtt.loop())
+   if (len < 8)
+      return;
+   uint32_t seq = le32 (p),
+      crc = le32 (p + 4);
+   p += 8;
+   len -= 8;
+   if (seq == otamseq && len && len <= otasize - otadone && settings_crc (p, len) == crc)
+   {
+      otalast = (millis ()? : 1);
+      br_sha256_update (&otactx, p, len);
+      otadone += len;
+      otamseq++;
+      if (otadone == otasize)
+      {                         // Last chunk, checked and written from loop
+         otatail = (byte *) malloc (len);
+         if (!otatail)
+         {
+            otaend (PSTR ("No memory"));
+            return;
+         }
+         memcpy (otatail, p, len);
+         otataillen = len;
+         otaphase = OTAVERIFY;
+      } else
+      {
+         const char *e = otawrite (p, len);
+         if (e)
+         {
+            otaend (e);
+            return;
+         }
+         otaprogress (false);
+         if (otamseq % (OTAMQTTWINDOW / 2))
+            return;
+      }
+   } else if (seq >= otamseq)
+   {                            // Gap or bad CRC, ask once for the one we want
+      if (otamnack == otamseq)
+         return;
+      otamnack = otamseq;
+   }                            // Else duplicate, so ack again
+   pub (prefixinfo, "otaack", F ("%lu"), (unsigned long) otamseq);
+}
+
+static void
+otaloop ()
+{                               // Do OTA steps for up to OTABUDGET, called from loop while OTA in progress
+   if (otaphase == OTADONE)
+   {
+      if (!otaheld)
+         otareboot ();
+      return;
+   }
+   if (otaphase == OTAMQTT)
+   {                            // Chunks arrive from mqtt.loop()
+      if ((int) (millis () - otalast) <= OTAMQTTTIMEOUT)
+         return;
+      otaend (PSTR ("Timeout"));
+   }
+   unsigned long start = millis ();
+   int r;
+   while (!(r = otastep ()) && (int) (millis () - start) < OTABUDGET);
+   if (r > 0)
+   {                            // Image ready
+      otamqttclosed = false;
+      if (otamqttbuf)
+      {
+         mqtt.setBufferSize (otamqttbuf);
+         otamqttbuf = 0;
+      }
+      pub (true, prefixstate, NULL, F ("0 OTA Ready"));
+      app_command ("ota", NULL, 0);
+      return;
+   }
+   if (!r)
+      return;
+   if (otamissing && otanext ())
+      return;                   // Try next variant
+   if (otanospace && !otaminimal)
+   {                            // try smaller which should then be able to load the real code.
+      otaminimal = true;
+      strcpy_P (otabase, PSTR ("/Minimal.ino." BOARD ".bin"));
+      otavariant = 0;
+      if (otanext ())
+         return;
+   }
+   otaphase = OTAIDLE;          // Give up, carry on with current image
+   otamqttclosed = false;
+   if (otamqttbuf)
+   {
+      mqtt.setBufferSize (otamqttbuf);
+      otamqttbuf = 0;
+   }
+   pub (true, prefixstate, NULL, F ("0 OTA Error %S"), otafail);
 }
 
 boolean
 upgrade (int appnamelen, const char *appname)
-{                               // Do OTA upgrade
+{                               // Start OTA upgrade, runs from loop, and reboots when done (unless held)
+   if (otaphase != OTAIDLE && otaphase != OTAFAIL)
+      return false;             // Already doing one
    debug ("Upgrade start");
    settings_save ();
-   char url[200];
    {
+      char *url = otabase;
       int p = 0,
-         e = sizeof (url) - 1;
+         e = sizeof (otabase) - 1;
       url[p++] = '/';
       if (appnamelen)
          p += snprintf_P (url + p, e - p, PSTR ("%.*s"), appnamelen, appname);
       else
       {                         // Check flash for saved app name
-         EEPROM.begin (MAXEEPROM);
-         int addr = 0;
-         int l = EEPROM.read (addr++),
+         uint32_t head[SETTINGSHEAD / 4];
+         const byte *b = (const byte *) head;
+         int addr = 0,
+            l = 0,
             i;
-         if (l)
-         {
-            addr += l;
-            l = EEPROM.read (addr++);
-            if (l)
-               for (i = 0; i < l; i++)
-                  if (p < e)
-                     url[p++] = EEPROM.read (addr++);
-         }
-         EEPROM.end ();
+         if (settings_pick (head) >= 0)
+            addr = 12;
+         else if (ESP.flashRead (SETTINGSSECTOR (0) * SPI_FLASH_SEC_SIZE, head, SETTINGSHEAD)
+                  && b[0] == sizeof (eepromsig) - 1 && !memcmp (b + 1, eepromsig, sizeof (eepromsig) - 1))
+            addr = sizeof (eepromsig);
+         if (addr)
+            l = b[addr++];
+         for (i = 0; i < l; i++)
+            if (p < e)
+               url[p++] = b[addr++];
       }
       if (p < e)
          p += snprintf_P (url + p, e - p, PSTR ("%S"), PSTR (".ino." BOARD ".bin"));
       url[p] = 0;
    }
-   ESPhttpUpdate.rebootOnUpdate (false);
-   int er = doupdate (url);
-   if (er == HTTP_UE_TOO_LESS_SPACE)
-   {                            // try smaller which should then be able to load the real code.
-      snprintf_P (url, sizeof (url), PSTR ("Minimal..ino." BOARD ".bin"));
-      er = doupdate (url);
-   } else if (er)
-      er = doupdate (url);      // Do again, it seems TLS can take too long for the header check, WTF, but session is cached to should work second time
-   if (mqtt.connected ())
-   {
-      mqtt.disconnect ();
-      delay (100);
-   }
-   WiFi.disconnect ();
-   delay (100);
-   ESP.restart ();              // Boot
-   ESP.reset ();                // Boot hard (?)
-   return false;                // Should not get here
+   otaminimal = false;
+   otavariant = 0;
+   if (otanext ())
+      return true;
+   otaphase = OTAIDLE;
+   return false;
 }
 
 const char *
-localsetting (const char *name, const byte * value, size_t len)
+localsetting (const char *tag, uint32_t hash, const byte * value, size_t len)
 {                               // Apply a local setting (return PROGMEM tag)
-#define s(n) do{const char*t=PSTR(#n);if(!strcasecmp_P(name,t)){n=(const char*)value;return t;}}while(0)
-#define n(n,d) do{const char*t=PSTR(#n);if(!strcasecmp_P(name,t)){n=(len?atoi((const char*)value):d);return t;}}while(0)
-#define f(n,l) do{const char*t=PSTR(#n);if(!strcasecmp_P(name,t)){if(len&&len!=l)return NULL;n=value;return t;}}while(0)
-   revk_settings
+   switch (hash)
+   {
+#define s(n) revk_setting_s(n)
+#define n(n,d) revk_setting_n(n,d)
+#define f(n,l) revk_setting_f(n,l)
+      revk_settings
 #undef f
 #undef n
 #undef s
-      return NULL;
+   }
+   return NULL;
 }
 
 #define isxchar(c) ((c)>='0'&&(c)<='9'||(c)>='a'&&(c)<='f'||(c)>='A'&&(c)<='F')
 
+static setting_t *
+setting_find (const char *tag, uint32_t hash, unsigned int *pos)
+{                               // Find setting, and set pos to where it is, or would be inserted
+   unsigned int lo = 0,
+      hi = setcount;
+   while (lo < hi)
+   {
+      unsigned int m = (lo + hi) / 2;
+      if (set[m].hash < hash)
+         lo = m + 1;
+      else
+         hi = m;
+   }
+   *pos = lo;
+   for (; lo < setcount && set[lo].hash == hash; lo++)
+      if (!strcasecmp_P (tag, set[lo].tag))
+      {
+         *pos = lo;
+         return set + lo;
+      }
+   return NULL;
+}
+
 boolean
 setting_apply (const char *tag, const byte * value, size_t len)
 {                               // Apply a setting
@@ -529,8 +2195,7 @@ setting_apply (const char *tag, const byte * value, size_t len)
       return false;             // Too big
    }
    // New setting
-   setting_t *news = NULL;      // New setting
-   const byte *val = NULL;      // Value in new setting
+   byte *val = NULL;            // New value, in arena with NULL added
    if (tag[0] == '0' && tag[1] == 'x')
    {                            // Convert from Hex
       tag += 2;                 // Strip 0x
@@ -551,11 +2216,11 @@ setting_apply (const char *tag, const byte * value, size_t len)
             n++;
          }
          len = n;
-         news = (setting_t *) malloc (sizeof (*news) + len + 1);
-         val = news->value;
+         if (len)
+            val = settings_alloc (len + 1);
          i = value;
-         const byte *o = val;
-         while (i < e)
+         byte *o = val;
+         while (o && i < e)
          {
             if (!isxchar (*i))
                break;
@@ -568,79 +2233,513 @@ setting_apply (const char *tag, const byte * value, size_t len)
             }
             while (i < e && (*i == ' ' || *i == ':'))
                i++;
-            *(byte *) o++ = v;
+            *o++ = v;
          }
-         *(byte *) o = 0;
-         news->len = len;
+         if (o)
+            *o = 0;
       }
    } else if (len)
-   {                            // Create new setting with new value
-      news = (setting_t *) malloc (sizeof (*news) + len + 1);
-      val = news->value;
-      memcpy ((void *) val, (void *) value, len);
-      ((char *) val)[len] = 0;
-      news->len = len;
+   {                            // New value
+      val = settings_alloc (len + 1);
+      if (val)
+      {
+         memmove (val, value, len);     // Can overlap when loading
+         val[len] = 0;
+      }
+   }
+   if (len && !val)
+   {
+      debugf ("No memory for setting %s", tag);
+      return false;
    }
    const char *newtag = NULL;
    // Existing setting
-   setting_t **ss = &set;
-   while (*ss && strcmp_P (tag, (*ss)->tag))
-      ss = &(*ss)->next;
-   if (!*ss && !news)
+   uint32_t hash = revk_hash (tag);
+   unsigned int pos;
+   setting_t *s = setting_find (tag, hash, &pos);
+   boolean had = (s && s->len); // Has existing value (not pending delete)
+   if (!had && !val)
    {
       debugf ("Non setting: %s", tag);
       return true;              // No new value and no existing value
    }
-   if (*ss && news && (*ss)->len == len && !memcmp ((*ss)->value, val, len))
+   if (had && val && s->len == len && !memcmp (s->value, val, len))
    {                            // Same
       debugf ("Unchanged setting: %s %.*s (%d)", tag, len, val, len);
-      free (news);
       return true;              // Value has not changed
    }
    debugf ("Setting: %s %.*s (%d)", tag, len, val, len);
    unsigned int newlen = setlen;
-   if (*ss)
-      newlen -= strlen (tag) + 1 + (*ss)->len + 1;
-   if (news)
-      newlen += strlen (tag) + 1 + len + 1;
-   if (newlen > MAXEEPROM)
-   {
-      debugf ("Settings would take too much space %d/%d", newlen, MAXEEPROM);
-      if (news)
-         free (news);
+   if (had)
+      newlen -= settingsrec (strlen (tag), s->len);
+   if (val)
+      newlen += settingsrec (strlen (tag), len);
+   if (newlen > SPI_FLASH_SEC_SIZE)
+   {
+      debugf ("Settings would take too much space %d/%d", newlen, SPI_FLASH_SEC_SIZE);
       return false;             // Not a setting we know
    }
-   if (!(newtag = localsetting (tag, val, len)) && !(newtag = app_setting (tag, val, len)))
+   if (!s && setcount == setmax)
+   {                            // Grow table
+      setting_t *n = (setting_t *) realloc (set, (setmax + 8) * sizeof (*set));
+      if (!n)
+      {
+         debugf ("No memory for setting %s", tag);
+         return false;
+      }
+      set = n;
+      setmax += 8;
+   }
+   setrefknown = false;
+   setref = NULL;
+   if (!(newtag = localsetting (tag, hash, val, len)) && !(newtag = app_setting (tag, val, len)))
    {                            // Setting not accepted
       debugf ("Bad setting: %s", tag);
-      if (news)
-         free (news);
       return false;             // Not a setting we know
    }
-   setlen = newlen;
-   if (*ss)
-   {                            // Delete setting
-      setting_t *s = *ss;
-      *ss = s->next;
-      free (s);
+   setlen = newlen;
+   if (val)
+      settings_used (len + 1);
+   if (!s)
+   {                            // Add new setting
+      memmove (set + pos + 1, set + pos, (setcount - pos) * sizeof (*set));
+      setcount++;
+      s = set + pos;
+      s->hash = hash;
+   }
+   s->tag = newtag;
+   s->value = val;
+   s->len = (val ? len : 0);
+   s->dirty = true;
+   s->ref = setref;
+   s->known = setrefknown;
+   settingsupdate = ((millis () + 1000) ? : 1);
+   if (topicstem && (!strcasecmp_P (tag, PSTR ("hostname")) || !strncasecmp_P (tag, PSTR ("prefix"), 6)))
+   {                            // Topics change
+      free (topicstem);
+      topicstem = NULL;
+   }
+   if (!strcasecmp_P (tag, PSTR ("hostname")))
+   {
+      if (settingsbatch)
+         settingsbatch |= SETTINGSBATCHRESTART;
+      else
+         do_restart = (millis ()? : 1); // Changed hostname
+   }
+   if (!strncasecmp_P (tag, PSTR ("mqtt"), 4))
+   {
+      memset (broker, 0, sizeof (broker));      // Brokers may have changed, start scores again
+      if (settingsbatch)
+         settingsbatch |= SETTINGSBATCHMQTT;
+      else
+         do_mqttdisconnect = ((millis () + 1000) ? : 1);        // Changed MQTT settings
+   }
+   return true;                 // Found(not changed)
+}
+
+#define	SETTINGSBATCH	32      // Max settings in one batch
+
+static byte *
+json_string (byte * p, byte * e, byte ** end)
+{                               // Unescape JSON string in place (p is after opening quote), NULL terminate, return where NULL is, *end after closing quote
+   byte *o = p;
+   while (p < e && *p != '"')
+   {
+      byte c = *p++;
+      if (c == '\\')
+      {
+         if (p >= e)
+            return NULL;
+         c = *p++;
+         if (c == 'n')
+            c = '\n';
+         else if (c == 'r')
+            c = '\r';
+         else if (c == 't')
+            c = '\t';
+         else if (c == 'b')
+            c = '\b';
+         else if (c == 'f')
+            c = '\f';
+         else if (c == 'u')
+         {                      // Only 8 bit
+            unsigned int v = 0,
+               n;
+            for (n = 0; n < 4 && p < e && isxchar (*p); n++, p++)
+               v = (v << 4) + (*p & 0xF) + (*p >= 'A' ? 9 : 0);
+            if (n < 4 || v > 0xFF)
+               return NULL;
+            c = v;
+         }                      // Else " \ / as is
+      }
+      *o++ = c;
+   }
+   if (p >= e)
+      return NULL;
+   *o = 0;                      // Is at or before closing quote
+   *end = p + 1;
+   return o;
+}
+
+static boolean
+settings_batch (byte * p, unsigned int len, const char **fail)
+{                               // Apply JSON object of settings, all checked first, and all or none applied, with one save and reconnect/restart
+   struct batch_s
+   {
+      const char *tag;
+      const byte *value;
+      byte len;
+      byte *old;                // Old value for undo
+      byte oldlen;
+   } *b = (struct batch_s *) malloc (SETTINGSBATCH * sizeof (*b));
+   if (!b)
+      return false;
+   byte *e = p + len;
+   int n = 0,
+      i;
+   boolean ok = false;
+#define skip() while(p<e&&(*p==' '||*p=='\t'||*p=='\r'||*p=='\n'))p++
+   // Parse and check
+   skip ();
+   if (p < e && *p++ == '{')
+      while (1)
+      {
+         skip ();
+         if (!n && p < e && *p == '}')
+         {
+            ok = true;          // Empty
+            break;
+         }
+         if (n == SETTINGSBATCH || p >= e || *p++ != '"')
+            break;
+         byte *t = p;
+         byte *te = json_string (p, e, &p);
+         if (!te)
+            break;
+         b[n].tag = (const char *) t;
+         *fail = b[n].tag;
+         i = te - t;
+         if (strlen (b[n].tag) != i || !i || i > SETTINGSTAG + (t[0] == '0' && t[1] == 'x' ? 2 : 0))
+            break;
+         skip ();
+         if (p >= e || *p++ != ':')
+            break;
+         skip ();
+         if (p < e && *p == '"')
+         {                      // String
+            byte *v = ++p;
+            byte *ve = json_string (p, e, &p);
+            if (!ve)
+               break;
+            b[n].value = v;
+            i = ve - v;
+         } else
+         {                      // Number, true/false, or null (delete)
+            byte *v = p;
+            while (p < e && *p != ',' && *p != '}' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+               p++;
+            b[n].value = v;
+            i = p - v;
+            if (i == 4 && !memcmp (v, "null", 4))
+               i = 0;
+            else if (i == 4 && !memcmp (v, "true", 4))
+            {
+               b[n].value = (const byte *) "1";
+               i = 1;
+            } else if (i == 5 && !memcmp (v, "false", 5))
+            {
+               b[n].value = (const byte *) "0";
+               i = 1;
+            }
+         }
+         if (i > 255)
+            break;
+         b[n++].len = i;
+         skip ();
+         if (p < e && *p == ',')
+         {
+            p++;
+            continue;
+         }
+         if (p < e && *p == '}')
+            ok = true;
+         break;
+      }
+#undef skip
+   if (!ok)
+   {
+      debugf ("Bad settings batch at %d", len - (e - p));
+      free (b);
+      return false;
+   }
+   *fail = NULL;
+   // Apply, keeping old values to undo
+   settingsbatch = SETTINGSBATCHON;
+   for (i = 0; i < n; i++)
+   {
+      const char *t = b[i].tag; // As sent, may be 0x for hex
+      if (t[0] == '0' && t[1] == 'x')
+         b[i].tag = t + 2;      // Tag for undo, as old value is binary
+      unsigned int pos;
+      setting_t *s = setting_find (b[i].tag, revk_hash (b[i].tag), &pos);
+      b[i].oldlen = (s ? s->len : 0);
+      b[i].old = NULL;
+      if (b[i].oldlen && !(b[i].old = (byte *) malloc (b[i].oldlen)))
+         break;
+      if (b[i].oldlen)
+         memcpy (b[i].old, s->value, b[i].oldlen);
+      if (!setting_apply (t, b[i].value, b[i].len))
+         break;
+   }
+   ok = (i == n);
+   if (!ok)
+   {                            // Undo
+      *fail = b[i].tag;
+      debugf ("Settings batch failed at %s, undo", b[i].tag);
+      free (b[i].old);
+      while (i--)
+      {
+         setting_apply (b[i].tag, b[i].old, b[i].oldlen);
+         free (b[i].old);
+      }
+   } else
+      for (i = 0; i < n; i++)
+         free (b[i].old);
+   free (b);
+   byte actions = settingsbatch;
+   settingsbatch = 0;
+   if (ok && (actions & SETTINGSBATCHRESTART))
+      do_restart = (millis ()? : 1);    // Changed hostname
+   if (ok && (actions & SETTINGSBATCHMQTT))
+      do_mqttdisconnect = ((millis () + 1000) ? : 1);   // Changed MQTT settings
+   debugf ("Settings batch of %d %s", n, ok ? "applied" : "not applied");
+   return ok;
+}
+
+// Command handlers, sorted by hash, so found by binary search then one compare
+typedef struct command_s command_t;
+struct command_s
+{
+   uint32_t hash;               // revk_hash of tag
+   PGM_P tag;                   // Tag (PROGMEM or literal)
+   revk_command_t *handler;
+   byte priority;               // Higher runs first when queued
+   unsigned long calls;         // Stats
+   unsigned long us;            // Total time in handler
+   unsigned long usmax;         // Longest time in handler
+};
+static command_t *cmd = NULL;
+static unsigned int cmdcount = 0;
+static unsigned int cmdmax = 0;
+
+static command_t *
+command_find (const char *tag, uint32_t hash, unsigned int *posp)
+{                               // Find handler, or where it would go
+   unsigned int l = 0,
+      h = cmdcount;
+   while (l < h)
+   {
+      unsigned int m = (l + h) / 2;
+      if (cmd[m].hash < hash)
+         l = m + 1;
+      else
+         h = m;
+   }
+   if (posp)
+      *posp = l;
+   for (; l < cmdcount && cmd[l].hash == hash; l++)
+      if (!strcasecmp_P (tag, cmd[l].tag))
+         return &cmd[l];
+   return NULL;
+}
+
+static boolean
+command_add (PGM_P tag, revk_command_t * handler, byte priority = 0)
+{                               // Add, replace, or (NULL handler) remove a handler
+   char t[SETTINGSTAG + 1];
+   strncpy_P (t, tag, sizeof (t) - 1);
+   t[sizeof (t) - 1] = 0;
+   uint32_t hash = revk_hash (t);
+   unsigned int pos;
+   command_t *c = command_find (t, hash, &pos);
+   if (c)
+   {
+      if (handler)
+      {
+         c->tag = tag;
+         c->handler = handler;
+         c->priority = priority;
+      } else
+         memmove (c, c + 1, (cmd + --cmdcount - c) * sizeof (*c));
+      return true;
+   }
+   if (!handler)
+      return false;
+   if (cmdcount == cmdmax)
+   {
+      command_t *n = (command_t *) realloc (cmd, (cmdmax + 8) * sizeof (*cmd));
+      if (!n)
+         return false;
+      cmd = n;
+      cmdmax += 8;
+   }
+   c = cmd + pos;
+   memmove (c + 1, c, (cmdcount++ - pos) * sizeof (*c));
+   memset (c, 0, sizeof (*c));
+   c->hash = hash;
+   c->tag = tag;
+   c->handler = handler;
+   c->priority = priority;
+   return true;
+}
+
+// Incoming commands and settings are queued, and run from loop, not from within mqtt.loop()
+// Queue entries are priority, type, tag len, payload len (2 bytes), tag (with NULL), payload
+// The queue is allocated when needed as CMDQUEUE plus the MQTT buffer size, so any message that can be received fits when empty
+#define	CMDQUEUE	1024    // Queue space in addition to one message
+#define	CMDBUDGET	20      // ms to spend running queued commands per loop (at least one is run)
+#define	CMDCOMMAND	0       // Entry types
+#define	CMDSETTING	1
+static byte *cmdq = NULL;       // Queue, malloc'd when needed
+static unsigned int cmdqsize = 0;       // Allocated size of queue
+static unsigned int cmdqlen = 0;        // Bytes in queue
+static unsigned int cmdqcount = 0;      // Entries in queue
+static unsigned int cmdqmax = 0;        // Stats
+static unsigned long cmdqueued = 0;
+static unsigned long cmddropped = 0;
+static const char *cmdtag = NULL;       // Tag of command running, for reply
+
+static boolean
+command_upgrade (const char *tag, const byte * message, size_t len)
+{                               // OTA upgrade
+   if (len)
+      upgrade (len, (const char *) message);    // App specific - special case
+   else
+      do_upgrade = (millis ()? : 1);
+   return true;
+}
+
+static boolean
+command_restart (const char *tag, const byte * message, size_t len)
+{
+   do_restart = (millis ()? : 1);
+   return true;
+}
+
+static boolean
+command_settings (const char *tag, const byte * message, size_t len)
+{                               // JSON object of settings
+   const char *fail = NULL;
+   byte *copy = (byte *) malloc (len + 1);      // Parsed in place, and tags used after
+   if (!copy)
+   {
+      pub (prefixerror, tag, F ("No memory"));
+      return true;
+   }
+   memcpy (copy, message, len);
+   copy[len] = 0;
+   if (!settings_batch (copy, len, &fail))
+      pub (prefixerror, tag, F ("Bad setting %s"), fail ? : "JSON");
+   free (copy);
+   return true;
+}
+
+static boolean
+command_factory (const char *tag, const byte * message, size_t len)
+{                               // Factory reset
+   if (len != appnamelen + 6 || memcmp (mychipid, message, 6) || memcmp (appname, message + 6, appnamelen))
+      return app_command (tag, message, len);
+   settings_reset ();
+   do_restart = (millis ()? : 1);
+   return true;
+}
+
+static boolean
+command_retryafter (const char *tag, const byte * message, size_t len)
+{                               // Do not reconnect for at least this many seconds, plus up to as much again, if disconnected
+   char temp[12];
+   if (!len || len >= sizeof (temp))
+      return false;
+   memcpy (temp, message, len);
+   temp[len] = 0;
+   long s = atol (temp);
+   if (s <= 0 || s > 86400)
+      return false;
+   mqttholdoff = ((millis () + s * 1000 + jitter () % (s * 1000)) ? : 1);
+   return true;
+}
+
+static boolean
+command_commands (const char *tag, const byte * message, size_t len)
+{                               // Report handler stats
+   pub (prefixinfo, tag, F ("Queued %lu, dropped %lu, max depth %u"), cmdqueued, cmddropped, cmdqmax);
+   for (unsigned int i = 0; i < cmdcount; i++)
+      pub (prefixinfo, tag, F ("%S calls %lu, max %luus, average %luus"), cmd[i].tag, cmd[i].calls, cmd[i].usmax,
+           cmd[i].calls ? cmd[i].us / cmd[i].calls : 0);
+   return true;
+}
+
+static void
+command_run (byte type, const char *tag, byte * payload, unsigned int len)
+{                               // Run a command or setting
+   if (type == CMDSETTING)
+   {
+      if (!setting_apply (tag, payload, len))
+         pub (prefixerror, tag, F ("Bad setting"));
+      return;
    }
-   if (news)
-   {                            // Add new setting
-      news->tag = newtag;
-      news->next = set;
-      set = news;
+   cmdtag = tag;
+   command_t *c = command_find (tag, revk_hash (tag), NULL);
+   if (c)
+   {
+      unsigned long start = micros ();
+      boolean ok = c->handler (tag, payload, len);
+      unsigned long us = micros () - start;
+      c->calls++;
+      c->us += us;
+      if (us > c->usmax)
+         c->usmax = us;
+      if (!ok)
+         pub (prefixerror, tag, F ("Bad command"));
+   } else if (!app_command (tag, payload, len))
+      pub (prefixerror, tag, F ("Bad command"));
+   cmdtag = NULL;
+}
+
+static void
+command_drain (unsigned long now)
+{                               // Run queued commands, highest priority first, within time budget
+   while (cmdqcount)
+   {
+      unsigned int pos = 0,
+         best = 0;
+      for (unsigned int i = 0; i < cmdqcount; i++)
+      {
+         if (cmdq[pos] > cmdq[best])
+            best = pos;
+         pos += 5 + cmdq[pos + 2] + cmdq[pos + 3] + (cmdq[pos + 4] << 8);
+      }
+      byte *e = cmdq + best;
+      unsigned int tlen = e[2],
+         len = e[3] + (e[4] << 8),
+         l = 5 + tlen + len;
+      command_run (e[1], (const char *) e + 5, e + 5 + tlen, len);
+      // Only ever appended to while running, so entry is still at same place
+      memmove (cmdq + best, cmdq + best + l, (cmdqlen -= l) - best);
+      if (!--cmdqcount)
+      {
+         free (cmdq);
+         cmdq = NULL;
+         cmdqsize = 0;
+      }
+      if ((int) (millis () - now) >= CMDBUDGET)
+         break;                 // Rest next loop
    }
-   settingsupdate = ((millis () + 1000) ? : 1);
-   if (!strcasecmp_P (tag, PSTR ("hostname")))
-      do_restart = (millis ()? : 1);    // Changed hostname
-   if (!strncasecmp_P (tag, PSTR ("mqtt"), 4))
-      do_mqttdisconnect = ((millis () + 1000) ? : 1);   // Changed MQTT settings
-   return true;                 // Found(not changed)
 }
 
 static void
 message (const char *topic, byte * payload, unsigned int len)
-{                               // Handle MQTT message
+{                               // Handle MQTT message, queued to run from loop
    debugf ("MQTT msg %s %.*s (%d)", topic, len, payload, len);
    char *p = strchr (topic, '/');
    if (!p)
@@ -651,41 +2750,57 @@ message (const char *topic, byte * payload, unsigned int len)
       p++;
    else
       p = NULL;
+   byte type,
+     priority = 0;
    int l;
    l = strlen (prefixcommand);
    if (p && !strncasecmp (topic, prefixcommand, l) && topic[l] == '/')
    {
-      if (!strcasecmp_P (p, PSTR ("upgrade")))
-      {                         // OTA upgrade
-         if (len)
-            upgrade (len, (const char *) payload);      // App specific - special case
-         else
-            do_upgrade = (millis ()? : 1);
-         return;
-      }
-      if (!strcasecmp_P (p, PSTR ("restart")))
-      {
-         do_restart = (millis ()? : 1);
+      if (otaphase == OTAMQTT && !strcasecmp_P (p, PSTR ("otachunk")))
+      {                         // Not queued
+         otachunk (payload, len);
          return;
       }
-      if (!strcasecmp_P (p, PSTR ("factory")) && len == appnamelen + 6 && !memcmp (mychipid, payload, 6)
-          && !memcmp (appname, payload + 6, appnamelen))
-      {                         // Factory reset
-         settings_reset ();
-         do_restart = (millis ()? : 1);
+      type = CMDCOMMAND;
+      command_t *c = command_find (p, revk_hash (p), NULL);
+      if (c)
+         priority = c->priority;
+   } else
+   {
+      l = strlen (prefixsetting);
+      if (p && !strncasecmp (topic, prefixsetting, l) && topic[l] == '/')
+         type = CMDSETTING;
+      else
          return;
-      }
-      if (!app_command (p, payload, len))
-         pub (prefixerror, p, F ("Bad command"));
+   }
+   unsigned int tlen = strlen (p) + 1,
+      need = 5 + tlen + len;
+   if (tlen > 255 || len > 0xFFFF)
+   {                            // Can never be queued
+      cmddropped++;
+      pub (prefixerror, p, F ("Too big"));
       return;
    }
-   l = strlen (prefixsetting);
-   if (p && !strncasecmp (topic, prefixsetting, l) && topic[l] == '/')
-   {
-      if (!setting_apply (p, payload, len))
-         pub (prefixerror, p, F ("Bad setting"));
+   if (!cmdq && (cmdq = (byte *) malloc (CMDQUEUE + mqtt.getBufferSize ())))
+      cmdqsize = CMDQUEUE + mqtt.getBufferSize ();
+   if (!cmdq || cmdqlen + need > cmdqsize)
+   {                            // Not now, but would fit when queue has drained
+      cmddropped++;
+      pub (prefixerror, p, F ("Busy"));
       return;
    }
+   byte *q = cmdq + cmdqlen;
+   *q++ = priority;
+   *q++ = type;
+   *q++ = tlen;
+   *q++ = len;
+   *q++ = (len >> 8);
+   memcpy (q, p, tlen);
+   memcpy (q + tlen, payload, len);
+   cmdqlen += need;
+   if (++cmdqcount > cmdqmax)
+      cmdqmax = cmdqcount;
+   cmdqueued++;
 }
 
 void
@@ -766,7 +2881,7 @@ ESPRevK::ESPRevK (const char *myappname, const char *myappversion, const char *m
       appname = myappname + i;
       appnamelen = l - i;
    }
-   setlen += appnamelen + 1;
+   setlen = settingshead (appnamelen);
    debugf ("Application start %.*s %s", appnamelen, appname, appversion);
    loadsettings ();
    // Override defaults
@@ -801,6 +2916,8 @@ ESPRevK::ESPRevK (const char *myappname, const char *myappversion, const char *m
       mqtthost = NULL;
    if (mqtthost2 && !*mqtthost2)
       mqtthost2 = NULL;
+   if (mqtthost3 && !*mqtthost3)
+      mqtthost3 = NULL;
    if (!prefixcommand)
       prefixcommand = PCPY ("command");
    if (!prefixsetting)
@@ -824,8 +2941,21 @@ ESPRevK::ESPRevK (const char *myappname, const char *myappversion, const char *m
    wifidisconnecthandler = WiFi.onStationModeDisconnected (wifidisconnect);
    sntp_set_timezone (timezone / 3600);
    if (ntphost)
-      sntp_setservername (0, (char *) ntphost);
+   {                            // SNTP keeps the pointer, and settings values move when packed, so a copy
+      static char ntpname[64];
+      strncpy (ntpname, ntphost, sizeof (ntpname) - 1);
+      sntp_setservername (0, ntpname);
+   }
    WiFi.setSleepMode (WIFI_NONE_SLEEP); // We assume we have no power issues
+   fastload ();
+   command_add (PSTR ("upgrade"), command_upgrade);
+   command_add (PSTR ("otamqtt"), command_otamqtt);
+   command_add (PSTR ("restart"), command_restart);
+   command_add (PSTR ("settings"), command_settings);
+   command_add (PSTR ("factory"), command_factory);
+   command_add (PSTR ("commands"), command_commands);
+   command_add (PSTR ("retryafter"), command_retryafter);
+   command_add (PSTR ("cacert"), command_cacert);
    mqtt.setCallback (message);
    debug ("RevK init done");
 }
@@ -849,6 +2979,8 @@ ESPRevK::loop ()
       app_command ("restart", NULL, 0);
       debug ("Restart");
       settings_save ();
+      tlssave ();
+      fastsave ();
       if (mqtt.connected ())
       {
          pub (true, prefixstate, NULL, F ("0 Restart"));
@@ -864,13 +2996,21 @@ ESPRevK::loop ()
    }
    if (do_upgrade && (int) (do_upgrade - now) <= 0)
    {
-      app_command ("restart", NULL, 0);
+      do_upgrade = 0;
       upgrade (appnamelen, appname);
-      return false;             // Uh
    }
+   if (otaphase != OTAIDLE)
+      otaloop ();
    // Save settings
    if (settingsupdate && (int) (settingsupdate - now) <= 0)
       settings_save ();
+   // Save TLS sessions (e.g. from app connections)
+   static long tlssavenext = 0;
+   if ((int) (tlssavenext - now) <= 0)
+   {
+      tlssavenext = now + 10000;
+      tlssave ();
+   }
 #ifdef GRATARP
    static long kickarp = 0;
    if ((int) (kickarp - now) <= 0)
@@ -884,6 +3024,11 @@ ESPRevK::loop ()
       }
    }
 #endif
+   if (fastleaseend && (int) (fastleaseend - now) <= 0)
+   {                            // Static IP from RTC no longer covered by lease, back to DHCP
+      fastleaseend = 0;
+      WiFi.config (0U, 0U, 0U);
+   }
    // WiFi reconnect
    static long sntpbackoff = 100;
    static long sntptry = sntpbackoff;
@@ -924,6 +3069,9 @@ ESPRevK::loop ()
       sntp_stop ();
       sntp_init ();
    }
+   // Commands received
+   if (cmdqcount)
+      command_drain (now);
    // MQTT reconnnect
    if (mqtthost)
    {                            // We are doing MQTT
@@ -936,52 +3084,63 @@ ESPRevK::loop ()
             mqtt.disconnect ();
          }
       }
-      if (!mqtt.loop ())
-      {                         // Not working
-         const char *host = mqttbackup ? mqtthost2 : mqtthost;
-         if ((!mqttretry || (int) (mqttretry - now) <= 0) && wificonnected)
-         {                      // Try reconnect
-            if (domqttopen ())
-               mqttconnected = true;
-            else
-            {                   // Failed reconnect
-               if (mqttconnected)
-               {                // No longer connected 
-                  mqttconnected = false;
-                  app_command ("disconnect", (const byte *) host, strlen ((char *) host));
-                  debugf ("MQTT failed reconnect %s", host);
-               }
-               if (mqttbackoff < 30000)
-               {                // Not connected to MQTT
-                  mqttbackoff *= 2;
-                  mqttretry = ((now + mqttbackoff) ? : 1);
-               } else
-               {
-                  if (mqtthost2 && (mqttsha1 || strcmp (mqtthost, mqtthost2)))
-                  {
-                     mqttbackup = !mqttbackup;
-                     mqttretry = 0;
-                     mqttbackoff = 1000;
-                  }
-                  if (!mqttbackup && (wifissid2 || wifissid3))
-                     WiFi.disconnect ();        // Retry at wifi level
-               }
-               return false;
+      const char *host = mqttname;
+      if (mqttphase != MQTTIDLE)
+      {                         // Connecting, one step per loop
+         int r = mqttstep ();
+         if (r > 0)
+            mqttconnected = true;
+         else if (r < 0)
+         {                      // Failed reconnect
+            if (mqttbackoff < retrymax)
+               mqttbackoff *= 2;        // Not connected to MQTT
+            else if (wifissid2 || wifissid3)
+            {                   // All brokers failing for a while
+               mqttbackoff = retrymin;
+               WiFi.disconnect ();      // Retry at wifi level
             }
-         } else if (mqttconnected)
+            mqttretry = ((now + backoff (&mqttdelay)) ? : 1);
+            if (mqttholdoff && (int) (mqttholdoff - mqttretry) > 0)
+               mqttretry = mqttholdoff;
+            mqttholdoff = 0;
+            return false;
+         }
+      } else if (!mqtt.loop ())
+      {                         // Not working
+         if (mqttconnected)
          {                      // No longer connected
             mqttconnected = false;
             app_command ("disconnect", (const byte *) host, strlen ((char *) host));
             debugf ("MQTT disconnected %s", host);
-            return false;
+            mqttdelay = 0;
+            if (mqttswitch)
+               mqttretry = 0;   // Moving broker, so straight away
+            else
+            {                   // Not straight away, so not all devices at once when broker restarts
+               mqttretry = ((now + backoff (&mqttdelay)) ? : 1);
+               if (mqttholdoff && (int) (mqttholdoff - mqttretry) > 0)
+                  mqttretry = mqttholdoff;
+               mqttholdoff = 0;
+            }
+            mqttswitch = false;
          }
+         if ((!mqttretry || (int) (mqttretry - now) <= 0) && wificonnected && !otamqttclosed)
+            mqttstep ();        // Start reconnect
       }
-   } else if (mqttconnected)
+   } else if (mqttconnected || mqttphase != MQTTIDLE)
    {                            // Uh? config change or something
+      mqttstop ();
       mqttconnected = false;
+      mqttswitch = false;
       app_command ("disconnect", NULL, 0);
       debug ("MQTT disconnected");
    }
+   if (mqttconnected)
+   {
+      pubdrain (now);
+      if (mqtthost2 || mqtthost3)
+         brokerprobe (now);
+   }
 #ifdef	REVKDEBUG
    static long ticker = 0;
    if ((int) (ticker - now) <= 0)
@@ -995,69 +3154,216 @@ ESPRevK::loop ()
    return wificonnected;
 }
 
+static unsigned int publeft = 0;        // Bytes still to write in streamed publish
+
+// Non retained event/info/error messages are queued when MQTT is down, and replayed in order, paced, when back
+// Queue entries are topic len, payload len (2 bytes), topic, payload. Oldest dropped if full.
+#define	PUBQUEUE	1024    // Queue size
+#define	PUBPACE		20      // ms between replayed messages
+static byte *pubq = NULL;       // Queue, malloc'd when needed
+static unsigned int pubqlen = 0;        // Bytes in queue
+static unsigned int pubqcount = 0;      // Messages in queue
+static unsigned long pubqueued = 0;     // Stats
+static unsigned long pubdropped = 0;
+static unsigned long pubreplayed = 0;
+
 static boolean
-pubap (boolean retain, const __FlashStringHelper * prefix, const __FlashStringHelper * suffix,
-       const __FlashStringHelper * fmt, va_list ap)
+pubtopic (const char *topic, unsigned int len, boolean retain)
+{                               // Start streamed publish of len bytes, written straight to the connection
+   if (!mqttup () || !mqtt.beginPublish (topic, len, retain))
+      return false;
+   if (!pubfirst)
+      pubfirst = (millis ()? : 1);
+   publeft = len;
+   return true;
+}
+
+static boolean
+pubopen (boolean retain, const char *prefix, boolean prefixP, const char *suffix, boolean suffixP, unsigned int len)
+{                               // Start streamed publish of len bytes
+   if (!mqttup () || !hostname)
+      return false;             // No MQTT
+   char topic[TOPICMAX + 1];
+   topicmake (topic, prefix, prefixP, suffix, suffixP);
+   return pubtopic (topic, len, retain);
+}
+
+static boolean
+pubqueueable (boolean retain, const char *prefix, boolean prefixP)
+{                               // If this would be queued when MQTT down
+   return !retain && !prefixP && hostname && prefix && (prefix == prefixevent || prefix == prefixinfo || prefix == prefixerror);
+}
+
+static boolean
+pubqueue (const char *prefix, const char *suffix, boolean suffixP, unsigned int len, const byte * data)
+{                               // Add to queue
+   char topic[TOPICMAX + 1];
+   unsigned int tlen = topicmake (topic, prefix, false, suffix, suffixP);
+   unsigned int need = 3 + tlen + len;
+   if (need > PUBQUEUE || (!pubq && !(pubq = (byte *) malloc (PUBQUEUE))))
+   {
+      pubdropped++;
+      return false;
+   }
+   while (pubqlen + need > PUBQUEUE)
+   {                            // Drop oldest
+      unsigned int l = 3 + pubq[0] + pubq[1] + (pubq[2] << 8);
+      memmove (pubq, pubq + l, pubqlen -= l);
+      pubqcount--;
+      pubdropped++;
+   }
+   byte *q = pubq + pubqlen;
+   *q++ = tlen;
+   *q++ = len;
+   *q++ = (len >> 8);
+   memcpy (q, topic, tlen);
+   memcpy (q + tlen, data, len);
+   pubqlen += need;
+   pubqcount++;
+   pubqueued++;
+   debugf ("Queued %s (%d)", topic, pubqcount);
+   return true;
+}
+
+static size_t
+pubpart (const byte * data, size_t len)
+{                               // Write part of streamed publish
+   if (len > publeft)
+      len = publeft;
+   len = mqtt.write (data, len);
+   publeft -= len;
+   return len;
+}
+
+static boolean
+pubclose ()
+{                               // End streamed publish, padding if short as length already sent
+   boolean ok = !publeft;
+   while (publeft && mqtt.write ((uint8_t) 0))
+      publeft--;
+   publeft = 0;
+   return mqtt.endPublish () && ok;
+}
+
+static boolean
+pubdata (boolean retain, const char *prefix, boolean prefixP, const char *suffix, boolean suffixP, unsigned int len,
+         const byte * data)
 {
-   if (!mqtt.connected () || !hostname)
+   if (pubqueueable (retain, prefix, prefixP) && (pubqcount || !mqttup ()))
+      return pubqueue (prefix, suffix, suffixP, len, data);     // Queue, behind any already queued
+   if (retain && !prefixP && prefix == prefixstate && suffix && statecache > 0)
+   {                            // Retained state (not the top level status, which the will changes), check if unchanged
+      if (!mqttup () || !hostname)
+         return false;          // No MQTT
+      char topic[TOPICMAX + 1];
+      unsigned int tlen = topicmake (topic, prefix, prefixP, suffix, suffixP);
+      statecache_t *c = statecachefind (statehash ((const byte *) topic, tlen));
+      uint32_t h = statehash (data, len, statehash ((const byte *) &len, sizeof (len)));
+      if (c && c->payload == h)
+      {
+         statesuppressed++;
+         return true;           // Unchanged, broker already has it
+      }
+      if (!pubtopic (topic, len, retain))
+         return false;
+      pubpart (data, len);
+      if (!pubclose ())
+         return false;
+      if (c)
+         c->payload = h;
+      statesent++;
+      return true;
+   }
+   if (!pubopen (retain, prefix, prefixP, suffix, suffixP, len))
+      return false;
+   pubpart (data, len);
+   return pubclose ();
+}
+
+static boolean
+pubfmt (boolean retain, const char *prefix, boolean prefixP, const char *suffix, boolean suffixP,
+        const __FlashStringHelper * fmt, va_list ap)
+{                               // Format and publish, malloc if too long for temp
+   if ((!mqttup () || !hostname) && !pubqueueable (retain, prefix, prefixP))
       return false;             // No MQTT
-   char temp[200] = {
-   };
+   char temp[200];
+   char *buf = temp;
+   int l = 0;
    if (fmt)
-      vsnprintf_P (temp, sizeof (temp), (PGM_P) fmt, ap);
-   char topic[101];
-   if (suffix)
-      snprintf_P (topic, sizeof (topic), PSTR ("%S/%.*s/%s/%S"), (PGM_P) prefix, appnamelen, appname, hostname, (PGM_P) suffix);
-   else
-      snprintf_P (topic, sizeof (topic), PSTR ("%S/%.*s/%s"), (PGM_P) prefix, appnamelen, appname, hostname);
-   return mqtt.publish (topic, temp, retain);
+   {
+      va_list ap2;
+      va_copy (ap2, ap);
+      l = vsnprintf_P (temp, sizeof (temp), (PGM_P) fmt, ap);
+      if (l < 0)
+         l = 0;
+      else if (l >= (int) sizeof (temp))
+      {
+         if ((buf = (char *) malloc (l + 1)))
+            vsnprintf_P (buf, l + 1, (PGM_P) fmt, ap2);
+         else
+         {                      // Truncate
+            buf = temp;
+            l = sizeof (temp) - 1;
+         }
+      }
+      va_end (ap2);
+   }
+   boolean ret = pubdata (retain, prefix, prefixP, suffix, suffixP, l, (const byte *) buf);
+   if (buf != temp)
+      free (buf);
+   return ret;
+}
+
+static boolean
+pubap (boolean retain, const __FlashStringHelper * prefix, const __FlashStringHelper * suffix,
+       const __FlashStringHelper * fmt, va_list ap)
+{
+   return pubfmt (retain, (PGM_P) prefix, true, (PGM_P) suffix, true, fmt, ap);
 }
 
 static boolean
 pubap (boolean retain, const char *prefix, const __FlashStringHelper * suffix, const __FlashStringHelper * fmt, va_list ap)
 {
-   if (!mqtt.connected () || !hostname)
-      return false;             // No MQTT
-   char temp[200] = {
-   };
-   if (fmt)
-      vsnprintf_P (temp, sizeof (temp), (PGM_P) fmt, ap);
-   char topic[101];
-   if (suffix)
-      snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/%s/%S"), prefix, appnamelen, appname, hostname, (PGM_P) suffix);
-   else
-      snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/%s"), prefix, appnamelen, appname, hostname);
-   return mqtt.publish (topic, temp, retain);
+   return pubfmt (retain, prefix, false, (PGM_P) suffix, true, fmt, ap);
 }
 
 static boolean
 pubap (boolean retain, const char *prefix, const char *suffix, const __FlashStringHelper * fmt, va_list ap)
 {
-   if (!mqtt.connected () || !hostname)
-      return false;             // No MQTT
-   char temp[200] = {
-   };
-   if (fmt)
-      vsnprintf_P (temp, sizeof (temp), (PGM_P) fmt, ap);
-   char topic[101];
-   if (suffix)
-      snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/%s/%s"), prefix, appnamelen, appname, hostname, suffix);
-   else
-      snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/%s"), prefix, appnamelen, appname, hostname);
-   return mqtt.publish (topic, temp, retain);
+   return pubfmt (retain, prefix, false, suffix, false, fmt, ap);
 }
 
 static boolean
 pubap (boolean retain, const char *prefix, const __FlashStringHelper * suffix, unsigned int len, const byte * data)
 {
-   if (!mqtt.connected () || !hostname)
-      return false;             // No MQTT
-   char topic[101];
-   if (suffix)
-      snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/%s/%s"), prefix, appnamelen, appname, hostname, suffix);
-   else
-      snprintf_P (topic, sizeof (topic), PSTR ("%s/%.*s/%s"), prefix, appnamelen, appname, hostname);
-   return mqtt.publish (topic, data, len, retain);
+   return pubdata (retain, prefix, false, (PGM_P) suffix, true, len, data);
+}
+
+static void
+pubdrain (unsigned long now)
+{                               // Send next queued message, if due
+   static unsigned long next = 0;
+   if (!pubqcount || (int) (next - now) > 0)
+      return;
+   next = now + PUBPACE;
+   unsigned int tlen = pubq[0],
+      len = pubq[1] + (pubq[2] << 8);
+   char topic[TOPICMAX + 1];
+   memcpy (topic, pubq + 3, tlen);
+   topic[tlen] = 0;
+   if (!pubtopic (topic, len, false))
+      return;                   // Try later
+   pubpart (pubq + 3 + tlen, len);
+   if (!pubclose ())
+      return;                   // Try later
+   memmove (pubq, pubq + 3 + tlen + len, pubqlen -= 3 + tlen + len);
+   pubqcount--;
+   pubreplayed++;
+   if (pubqcount)
+      return;
+   free (pubq);
+   pubq = NULL;
+   pub (prefixinfo, "queue", F ("Queued %lu, replayed %lu, dropped %lu"), pubqueued, pubreplayed, pubdropped);
 }
 
 static boolean
@@ -1246,6 +3552,54 @@ boolean
    return ret;
 }
 
+boolean
+ESPRevK::pubbegin (const char *prefix, const char *suffix, unsigned int len, boolean retain)
+{
+   return pubopen (retain, prefix, false, suffix, false, len);
+}
+
+boolean
+ESPRevK::pubbegin (const char *prefix, const __FlashStringHelper * suffix, unsigned int len, boolean retain)
+{
+   return pubopen (retain, prefix, false, (PGM_P) suffix, true, len);
+}
+
+size_t
+ESPRevK::pubwrite (const byte * data, size_t len)
+{
+   return pubpart (data, len);
+}
+
+boolean
+ESPRevK::pubend ()
+{
+   return pubclose ();
+}
+
+boolean
+ESPRevK::command (const __FlashStringHelper * tag, revk_command_t * handler, byte priority)
+{
+   return command_add ((PGM_P) tag, handler, priority);
+}
+
+boolean
+ESPRevK::command (const char *tag, revk_command_t * handler, byte priority)
+{
+   return command_add (tag, handler, priority);
+}
+
+boolean
+ESPRevK::reply (const __FlashStringHelper * fmt, ...)
+{
+   if (!cmdtag)
+      return false;
+   va_list ap;
+   va_start (ap, fmt);
+   boolean ret = pubap (false, prefixinfo, cmdtag, fmt, ap);
+   va_end (ap);
+   return ret;
+}
+
 boolean
 ESPRevK::setting (const __FlashStringHelper * tag, const char *value)
 {
@@ -1273,6 +3627,12 @@ ESPRevK::ota (int delay)
       do_upgrade = ((millis () + delay) ? : 1);
 }
 
+void
+ESPRevK::otahold (boolean hold)
+{
+   otaheld = hold;
+}
+
 boolean
 ESPRevK::restart (int delay)
 {
@@ -1289,21 +3649,333 @@ myclient (WiFiClient & client)
 }
 
 #include "lecert.h"
-static void
-myclientTLS (WiFiClientSecure & client, const byte * sha1)
+// TLS sessions are cached per host, and kept in RTC memory, so they can be resumed after restart or deep sleep
+#define	TLSSESSIONS	3
+#define	RTCSESSION	REVKRTC // RTC user memory offset (words), first 128 bytes are used by OTA, negative for none
+typedef struct tlsrtc_s tlsrtc_t;
+struct tlsrtc_s
+{                               // As stored in RTC memory
+   uint32_t crc;                // CRC32 of rest
+   uint32_t host[TLSSESSIONS];  // revk_hash of host
+   uint32_t used[TLSSESSIONS];  // Last used, for replacing oldest
+   uint16_t mfln[TLSSESSIONS];  // Max fragment length, 0 not probed, 1 not supported
+   br_ssl_session_parameters session[TLSSESSIONS];
+};
+static BearSSL::Session tlssession[TLSSESSIONS];
+static uint32_t tlshost[TLSSESSIONS];
+static uint32_t tlsused[TLSSESSIONS];
+static uint16_t tlsmfln[TLSSESSIONS];
+static uint32_t tlstick = 0;
+static uint32_t tlscrc = 0;     // CRC last saved
+static BearSSL::Session *tlscheck = NULL;       // Session offered on last connect
+static byte tlsid[32];          // and its ID
+static byte tlsidlen = 0;
+
+static uint32_t
+tlsrtccrc (tlsrtc_t * r)
 {
+   return settings_crc ((byte *) r + sizeof (r->crc), sizeof (*r) - sizeof (r->crc));
+}
+
+static void
+tlsload ()
+{                               // Load sessions from RTC memory, once
+   static boolean loaded = false;
+   if (loaded)
+      return;
+   loaded = true;
+   tlsrtc_t r;
+   if (RTCSESSION < 0 || !ESP.rtcUserMemoryRead (RTCSESSION, (uint32_t *) & r, sizeof (r)) || r.crc != tlsrtccrc (&r))
+      return;                   // Not valid, e.g. power on
+   tlscrc = r.crc;
+   for (int n = 0; n < TLSSESSIONS; n++)
+   {
+      tlshost[n] = r.host[n];
+      tlsused[n] = r.used[n];
+      tlsmfln[n] = r.mfln[n];
+      if (tlsused[n] > tlstick)
+         tlstick = tlsused[n];
+      memcpy (tlssession[n].getSession (), &r.session[n], sizeof (r.session[n]));
+   }
+}
+
+static void
+tlssave ()
+{                               // Save sessions to RTC memory, if changed
+   if (!tlstick || RTCSESSION < 0)
+      return;                   // Not used
+   tlsrtc_t r;
+   memset (&r, 0, sizeof (r));
+   for (int n = 0; n < TLSSESSIONS; n++)
+   {
+      r.host[n] = tlshost[n];
+      r.used[n] = tlsused[n];
+      r.mfln[n] = tlsmfln[n];
+      memcpy (&r.session[n], tlssession[n].getSession (), sizeof (r.session[n]));
+   }
+   r.crc = tlsrtccrc (&r);
+   if (r.crc != tlscrc && ESP.rtcUserMemoryWrite (RTCSESSION, (uint32_t *) & r, sizeof (r)))
+      tlscrc = r.crc;
+}
+
+static void
+tlsdone ()
+{                               // Connected, count if session resumed, and save
+   if (!tlscheck)
+      return;
+   br_ssl_session_parameters *p = tlscheck->getSession ();
+   if (tlsidlen && p->session_id_len == tlsidlen && !memcmp (p->session_id, tlsid, tlsidlen))
+      tlshit++;
+   else
+      tlsmiss++;
+   tlscheck = NULL;
+   tlssave ();
+}
+
+// Trust anchors are decoded once, and shared by all TLS clients not using a fingerprint
+#define	TLSANCHORS	4       // Max added by cacert command
+static BearSSL::X509List *tlsanchors = NULL;
+static uint32_t tlsanchorcrc[TLSANCHORS];       // CRC of each added, so a retained cacert is not added again on reconnect
+static byte tlsanchoradded = 0;
+
+static boolean
+tlsanchor (const byte * der, size_t len)
+{                               // Add DER certificate (PROGMEM or RAM)
+   byte *buf = (byte *) malloc (len);
+   if (!buf)
+      return false;
+   memcpy_P (buf, der, len);
+   boolean ok = tlsanchors->append (buf, len);
+   free (buf);
+   return ok;
+}
+
+static BearSSL::X509List *
+tlstrust ()
+{                               // The trust anchors
+   if (!tlsanchors)
+   {
+      tlsanchors = new BearSSL::X509List ();
+      tlsanchor (ISRGCert, sizeof (ISRGCert));
+      tlsanchor (LECert, sizeof (LECert));
+   }
+   return tlsanchors;
+}
+
+static boolean
+command_cacert (const char *tag, const byte * message, size_t len)
+{                               // Add trust anchor, DER or PEM
+   if (!len)
+      return false;
+   uint32_t crc = settings_crc (message, len);
+   for (int i = 0; i < tlsanchoradded; i++)
+      if (tlsanchorcrc[i] == crc)
+         return true;           // Already added
+   if (tlsanchoradded == TLSANCHORS)
+      return false;
+   tlstrust ();
+   boolean ok;
+   if (*message == '-')
+   {                            // PEM
+      char *pem = (char *) malloc (len + 1);
+      if (!pem)
+         return false;
+      memcpy (pem, message, len);
+      pem[len] = 0;
+      ok = tlsanchors->append (pem);
+      free (pem);
+   } else
+      ok = tlsanchor (message, len);
+   if (!ok)
+      return false;
+   tlsanchorcrc[tlsanchoradded++] = crc;
+   pub (prefixinfo, tag, F ("%u trust anchors"), tlsanchors->getCount ());
+   return true;
+}
+
+static int
+tlsslot (const char *host)
+{                               // Session slot for host, replacing oldest if new host
+   tlsload ();
+   uint32_t h = revk_hash (host);
+   int n,
+     old = 0;
+   for (n = 0; n < TLSSESSIONS && tlshost[n] != h; n++)
+      if (tlsused[n] < tlsused[old])
+         old = n;
+   if (n == TLSSESSIONS)
+   {                            // New host, replace oldest
+      n = old;
+      tlshost[n] = h;
+      tlsmfln[n] = 0;
+      memset (tlssession[n].getSession (), 0, sizeof (br_ssl_session_parameters));
+   }
+   return n;
+}
+
+static const uint16_t tlsmflnsize[] = { 512, 1024, 4096 };
+
+static boolean
+tlsmflnstep (const char *host, uint16_t port, byte i)
+{                               // Probe i'th max fragment length for host, once per host as probe is a connection, true if more to probe
+   int n = tlsslot (host);
+   if (tlsmfln[n] || i >= sizeof (tlsmflnsize) / sizeof (*tlsmflnsize))
+      return false;             // Known
+   if (WiFiClientSecure::probeMaxFragmentLength (host, port, tlsmflnsize[i]))
+      tlsmfln[n] = tlsmflnsize[i];      // Smallest server supports
+   else if (i + 1 == sizeof (tlsmflnsize) / sizeof (*tlsmflnsize))
+      tlsmfln[n] = 1;           // Not supported
+   else
+      return true;
+   debugf ("TLS %s MFLN %d", host, tlsmfln[n]);
+   return false;
+}
+
+static unsigned int
+myclientTLS (WiFiClientSecure & client, const byte * sha1, const char *host, uint16_t port)
+{                               // Set up TLS client, returns max fragment length if negotiated
    if (sha1)
       client.setFingerprint (sha1);
    else
-      client.setCACert_P (LECert, sizeof (LECert));
-   static BearSSL::Session sess;
-   client.setSession (&sess);
+      client.setTrustAnchors (tlstrust ());
+   if (!host)
+   {                            // Shared session
+      static BearSSL::Session sess;
+      client.setSession (&sess);
+      return 0;
+   }
+   if (port)
+      for (byte i = 0; tlsmflnstep (host, port, i); i++);      // All at once if not probed in steps already
+   int n = tlsslot (host);
+   if (port && tlsmfln[n] > 1)
+      client.setBufferSizes (tlsmfln[n], 512);  // Instead of default 16K receive buffer
+   else
+      client.setBufferSizes (16384, 512);       // Default, as client may have been set up for a server that has MFLN
+   tlsused[n] = ++tlstick;
+   br_ssl_session_parameters *p = tlssession[n].getSession ();
+   tlscheck = &tlssession[n];
+   tlsidlen = p->session_id_len;
+   memcpy (tlsid, p->session_id, sizeof (tlsid));
+   client.setSession (&tlssession[n]);
+   return port && tlsmfln[n] > 1 ? tlsmfln[n] : 0;
 }
 
-void
-ESPRevK::clientTLS (WiFiClientSecure & client, const byte * sha1)
+// Fast reconnect, details of the last connection are kept in RTC memory after the TLS sessions, on sleep or restart
+// On start they are used once, the same AP and channel, the DHCP lease as a static IP (while it has time left), and the broker address
+#define	RTCFAST		(RTCSESSION + (sizeof (tlsrtc_t) + 3) / 4)      // Words, all of RTC user memory is 128 words
+#define	FASTLEASEMIN	60      // s of DHCP lease that must be left on wake to use it as static IP
+typedef struct fastrtc_s fastrtc_t;
+struct fastrtc_s
+{                               // As stored in RTC memory
+   uint32_t crc;                // CRC32 of rest
+   uint32_t ssid;               // revk_hash of SSID
+   uint32_t ip;                 // DHCP lease (0 if none, or not enough time left)
+   uint32_t gw;
+   uint32_t mask;
+   uint32_t dns;
+   uint32_t lease;              // s left on lease when next started
+   uint32_t broker;             // revk_hash of broker name
+   uint32_t brokerip;
+   byte bssid[6];
+   byte chan;
+};
+static_assert (RTCSESSION < 0 || (RTCSESSION >= 32 && RTCFAST * 4 + sizeof (fastrtc_t) <= 512),
+               "REVKRTC: TLS sessions and fast reconnect must fit RTC user memory from word 32 to 127");
+
+static uint32_t
+fastrtccrc (fastrtc_t * r)
+{
+   return settings_crc ((byte *) r + sizeof (r->crc), sizeof (*r) - sizeof (r->crc));
+}
+
+static uint32_t
+fastlease ()
+{                               // s left on DHCP lease
+   if (fastleaseend)
+      return (int) (fastleaseend - millis ()) > 0 ? (fastleaseend - millis ()) / 1000 : 0;
+   struct dhcp *d = (netif_default ? netif_dhcp_data (netif_default) : NULL);
+   if (!d || d->state != DHCP_STATE_BOUND || d->t0_timeout <= d->lease_used)
+      return 0;
+   return (d->t0_timeout - d->lease_used) * DHCP_COARSE_TIMER_SECS;
+}
+
+static void
+fastload ()
+{                               // Load fast reconnect details from RTC memory, and invalidate, so not used after a crash
+   fastrtc_t r;
+   if (RTCSESSION < 0 || !ESP.rtcUserMemoryRead (RTCFAST, (uint32_t *) & r, sizeof (r)) || r.crc != fastrtccrc (&r))
+      return;                   // Not valid, e.g. power on
+   uint32_t zap = 0;
+   ESP.rtcUserMemoryWrite (RTCFAST, &zap, sizeof (zap));
+   fastbroker = r.broker;
+   fastbrokerip = r.brokerip;
+   fastused = true;
+   const char *ssid = NULL,
+      *pass = NULL;
+   if (wifissid && revk_hash (wifissid) == r.ssid)
+   {
+      ssid = wifissid;
+      pass = wifipass;
+   } else if (wifissid2 && revk_hash (wifissid2) == r.ssid)
+   {
+      ssid = wifissid2;
+      pass = wifipass2;
+   } else if (wifissid3 && revk_hash (wifissid3) == r.ssid)
+   {
+      ssid = wifissid3;
+      pass = wifipass3;
+   }
+   if (!ssid)
+      return;                   // Settings changed
+   strncpy (lastssid, ssid, sizeof (lastssid) - 1);
+   strncpy (lastpass, pass ? : "", sizeof (lastpass) - 1);
+   lastchan = r.chan;
+   memcpy ((void *) copybssid, r.bssid, sizeof (copybssid));
+   lastbssid = copybssid;
+   lastbssidfixed = wififixed (lastbssid);
+   if (r.ip && r.lease >= FASTLEASEMIN)
+   {
+      WiFi.config (r.ip, r.gw, r.mask, r.dns);
+      fastleaseend = ((millis () + (r.lease > 86400 ? 86400 : r.lease) * 1000) ? : 1);
+   }
+   debugf ("Fast reconnect %s %d lease %u", ssid, lastchan, r.lease);
+}
+
+static void
+fastsave (unsigned long s)
+{                               // Save fast reconnect details to RTC memory, s is how long we will be asleep
+   if (RTCSESSION < 0)
+      return;
+   fastrtc_t r;
+   memset (&r, 0, sizeof (r));
+   if (WiFi.isConnected () && *lastssid)
+   {
+      r.ssid = revk_hash (lastssid);
+      memcpy (r.bssid, WiFi.BSSID (), sizeof (r.bssid));
+      r.chan = WiFi.channel ();
+      uint32_t lease = fastlease ();
+      if (lease > s + FASTLEASEMIN)
+      {
+         r.lease = lease - s;
+         r.ip = WiFi.localIP ();
+         r.gw = WiFi.gatewayIP ();
+         r.mask = WiFi.subnetMask ();
+         r.dns = WiFi.dnsIP ();
+      }
+   }
+   if (mqtt.connected ())
+   {
+      r.broker = revk_hash (mqttname);
+      r.brokerip = mqttip;
+   }
+   r.crc = fastrtccrc (&r);
+   ESP.rtcUserMemoryWrite (RTCFAST, (uint32_t *) & r, sizeof (r));
+}
+
+unsigned int
+ESPRevK::clientTLS (WiFiClientSecure & client, const byte * sha1, const char *host, uint16_t port)
 {
-   return myclientTLS (client, sha1);
+   return myclientTLS (client, sha1, host, port);
 }
 
 void
@@ -1312,6 +3984,8 @@ ESPRevK::sleep (unsigned long s)
    if (!s)
       return;                   // Duh
    debugf ("Sleeping for %d seconds, good night...", s);
+   tlssave ();
+   fastsave (s);
    if (mqtt.connected ())
    {
       pub (true, prefixstate, NULL, F ("0 Sleep"));
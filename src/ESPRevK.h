@@ -1,13 +1,19 @@
 // RevK platform
 
 //#define REVKDEBUG	Serial              // If defined, does serial debug at 74880
+//#define REVKRTC	32                  // RTC user memory word used from (build flag, e.g. -DREVKRTC=40, 44 at most), -1 to not use RTC memory
 
 // This is a set of functions used in a number of projects by me, and a few friends
 // It sets up WiFi, and ensures reconnect
-// It sets ip MQTT, and ensures reconnect
+// It sets ip MQTT, and ensures reconnect (in steps from loop, needs PubSubClient 2.8 or later)
 // It provides a framework for publishing MQTT messages in a formal (similar to Tasmota)
 // It allows commands to be accepted by MQTT and calls the app with them
 // It manages EEPROM settings for itself and the app
+// Settings use the EEPROM flash sector, as an append only log, compacted in place when full
+// For power cut safe compaction, reserve the sector below EEPROM with a linker script that ends the FS a sector lower
+// (_FS_end at least 0x1000 below _EEPROM_start, even with no FS, as OTA uses up to _FS_start), it is then used as a second slot
+// The default layout, with or without FS, has a single slot, and compacting in place is not safe against a power cut (torn
+// write or erase), which can lose all settings, see extras/settingsfault.cpp which cuts power at every flash write and erase
 //
 // MQTT topic style is :-
 // prefix/app/hostname/suffix
@@ -19,20 +25,41 @@
 // otahost	OTA hostname	(always TLS using Let's Encrypt)
 // wifissid	WiFi SSID	(default for set up is IoT)
 // wifipass	WiFi Password	(default for set up is security)
-// mqtthost	MQTT hostname	(assumed to be local and so non TLS)
+// mqtthost	MQTT hostname	(non TLS unless mqttsha1 set), can be host:port
+// mqtthost2	Backup MQTT hostname (non TLS unless mqttsha12 set), and mqtthost3/mqttsha13 similarly
 // mqttuser	MQTT username	(default is empty)
 // mqttpass	MQTT password	(default is empty)
-// mqttport	MQTT port number (default is 1883)
+// mqttport	MQTT port number for mqtthost (default is 1883, or 8883 for TLS)
 // prefix[xx]	The prefixes, e.g. prefixcmnd
+// retrymin	Minimum ms before WiFi/MQTT reconnect (default 1000), delays are random, between this and 3 times the last delay
+// retrymax	Maximum ms before WiFi/MQTT reconnect (default 30000)
+// roammargin	dB an AP must be better than the current one (smoothed) to move to it (default 8)
+// roammin	Minimum s between moving AP (default 300), an AP left soon after moving to it is skipped for a while
+// statecache	Number of state topics to remember, so unchanged retained state is not sent again (default 0, off)
 //
+// MQTT connects to the broker with best score, from connect time and recent failures, and moves back to a better one when it answers
+// On restart or wake from sleep() the last AP, channel, DHCP lease (as static IP while it lasts), broker address, and TLS sessions
+// are used from RTC memory, the info message on connect shows ms to first publish
+// RTC user memory words 32 to 115 (of 0-127) are used for this, TLS sessions then fast reconnect details
+// Words 0-31 are used by the core for OTA, so an app using RTC memory should use words 116 up, or move these with REVKRTC
 // Note that wifissid2, and wifissid3 (and wifipass2/wifipass3) can be defined.
 // If any are defined then WiFiMulti is used which only tries non-hidden SSIDs
 // To use with hidden SSID, *only* set wifissid/wifipass
 //
 // Use cmnd to send commands
 // Predefined commands are :-
-// upgrade	Do OTA upgrade from otahost via HTTPS
+// upgrade	Do OTA upgrade from otahost via HTTPS, .bin.<md5>.delta (patch of running image, see extras/otadelta.cpp) then .bin.gz (needs core 2.7+ eboot) preferred, resumed with Range if dropped, checked against SHA-256 before committing, progress as info/ota
+//		Manifest (if served) is .bin.sha256, sha256sum output for the variants on the server, e.g. sha256sum x.bin x.bin.gz x.bin.*.delta
+//		It is fetched once, and variants not listed in it are not requested
+//		Runs from loop, MQTT and app keep running, reboots when done, unless app has called otahold()
+// otamqtt	Size, SHA-256 (hex), and optional "delta", then image sent as otachunk commands over this connection (see ESPRevK.cpp, sent by extras/otamqtt.cpp)
 // restart	Do a restart (saving settings first)
+// commands	Report command queue stats, and calls and time for each registered command handler, as info
+// cacert	Add a TLS trust anchor (DER or PEM) to ISRG Root X1 and DST Root CA X3, send retained to have it on every connect
+// Messages received (topic and payload) are limited to 2048 bytes (MQTTBUFFER), larger ones are dropped by PubSubClient unseen
+// retryafter	Seconds, if disconnected do not reconnect for this long, plus random up to as long again (e.g. before broker restart)
+// settings	JSON object of settings, e.g. {"mqtthost":"x","mqttport":8883}, all checked and applied, or none, then one save/reconnect
+//		true/false are 1/0, null deletes, and the whole object has to fit the 2048 byte MQTT buffer with its topic
 //
 
 #ifdef REVKDEBUG
@@ -46,6 +73,10 @@
 #ifndef ESPRevK_H
 #define ESPRevK_H
 
+#ifndef	REVKRTC
+#define	REVKRTC	32
+#endif
+
 #define revk_settings   \
 s(hostname);            \
 s(otahost);             \
@@ -66,7 +97,10 @@ s(wifipass3);           \
 n(mqttreset,0);		\
 s(mqtthost);            \
 s(mqtthost2);           \
+s(mqtthost3);           \
 f(mqttsha1,20);         \
+f(mqttsha12,20);        \
+f(mqttsha13,20);        \
 s(mqttuser);            \
 s(mqttpass);            \
 s(mqttport);            \
@@ -78,15 +112,42 @@ s(prefixevent);         \
 s(prefixinfo);          \
 s(prefixerror);         \
 n(timezone,0);		\
+n(statecache,0);	\
+n(retrymin,1000);	\
+n(retrymax,30000);	\
+n(roammargin,8);	\
+n(roammin,300);		\
 
 #include "Arduino.h"
 #include <ESP8266WiFi.h>
 #include <PubSubClient.h>
 
+// Case insensitive FNV-1a hash of a tag, constexpr so it can be a case label
+// Settings are matched by switch on this hash then one compare, duplicate case means a collision, so a compile error
+constexpr uint32_t revk_hash(const char *t,uint32_t h=2166136261U)
+{ return *t?revk_hash(t+1,(h^(uint8_t)(*t>='A'&&*t<='Z'?*t+'a'-'A':*t))*16777619U):h; }
+
+// For use in app_setting(tag,value,len) with an X-macro list of settings, e.g.
+// switch(revk_hash(tag)){
+// #define s(n) revk_setting_s(n)
+//   app_settings
+// #undef s
+// }
+// return NULL;
+// These tell the library where the value is kept (revk_setting_ref), so it can move it there itself when settings are packed
+#define revk_setting_s(n) case revk_hash(#n):{const char*t=PSTR(#n);if(strcasecmp_P(tag,t))break;n=(const char*)value;revk_setting_ref(&n);return t;}
+#define revk_setting_n(n,d) case revk_hash(#n):{const char*t=PSTR(#n);if(strcasecmp_P(tag,t))break;n=(len?atoi((const char*)value):d);revk_setting_ref(NULL);return t;}
+#define revk_setting_f(n,l) case revk_hash(#n):{const char*t=PSTR(#n);if(strcasecmp_P(tag,t))break;if(len&&len!=l)return NULL;n=value;revk_setting_ref(&n);return t;}
+void revk_setting_ref(const void *ref);	// From app_setting, where the value pointer is kept (NULL if value not kept)
+
 // Functions expected in the app (return true if OK)
-boolean app_command(const char*tag, const byte *message, size_t len); // Called for incoming commands not already handled
+boolean app_command(const char*tag, const byte *message, size_t len); // Called (from loop) for incoming commands not already handled
+typedef boolean revk_command_t(const char*tag, const byte *message, size_t len); // Handler registered with command()
 const char * app_setting(const char *tag,const byte *value,size_t len);	// Called for settings from EEPROM 
-// value is NULL, or malloc'd with NULL added and not freed until next app setting with same tag
+// value is NULL, or has NULL added and stays valid until next app setting with same tag
+// app_setting is only called when the value changes, if the setting is applied with the revk_setting_x macros (or the app calls
+// revk_setting_ref), otherwise it is called again with the same value at a new address when settings storage is packed (on load,
+// and when about 256 bytes of changed values have built up since the last pack)
 // Return is PROGMEM pointer to the setting name if setting is accepted, or NULL if not accepted
 
 class ESPRevK 
@@ -102,7 +163,10 @@ class ESPRevK
 		   const char *mymqtthost=NULL,
 		   const char *mywifissid=NULL,
 		   const char *mywifipass=NULL);
-   void  clientTLS(WiFiClientSecure&,const byte *sha1=NULL);	// Secure TLS client (LE cert if no sha1)
+   // Secure TLS client (Let's Encrypt roots, and any from cacert, if no sha1), session kept per host if host set
+   // If port set too, max fragment length is negotiated, and buffers sized to match, returns fragment length (0 if not supported)
+   // TLS resumed counts in info cover MQTT and OTA connections, not ones made by the app with this
+   unsigned int clientTLS(WiFiClientSecure&,const byte *sha1=NULL,const char *host=NULL,uint16_t port=0);
    // Functions return true of "OK"
    boolean loop(void);	// Call in loop, returns false if wifi not connected
    boolean state(const __FlashStringHelper *tag, const __FlashStringHelper *fmt=NULL, ...); // Publish stat
@@ -121,9 +185,21 @@ class ESPRevK
    boolean pub(const __FlashStringHelper *prefix, const __FlashStringHelper *tag, const __FlashStringHelper *fmt=NULL, ...);	// Publish general
    boolean pub(boolean retain, const __FlashStringHelper *prefix, const __FlashStringHelper *tag,  const __FlashStringHelper *fmt=NULL, ...);	// Publish general (with retain)
    boolean pub(boolean retain, const char *prefix, const char *tag,  const __FlashStringHelper *fmt=NULL, ...);	// Publish general (with retain)
+   // Streamed publish of len bytes, e.g. pubbegin(get_prefixevent(),F("log"),len), then pubwrite() len bytes, then pubend()
+   boolean pubbegin(const char *prefix, const char *tag, unsigned int len, boolean retain=false);
+   boolean pubbegin(const char *prefix, const __FlashStringHelper *tag, unsigned int len, boolean retain=false);
+   size_t pubwrite(const byte *data, size_t len);	// Write part of payload, straight to connection
+   boolean pubend(void);	// End publish (padded if fewer than len bytes written)
+   // Register handler for a command, replaces existing handler for same tag, NULL handler removes, others go to app_command
+   // Commands are queued and run from loop(), higher priority first
+   // Any message that fits the MQTT buffer can be queued, error "Busy" if the queue is full for now, "Too big" if it can never be queued
+   boolean command(const __FlashStringHelper *tag, revk_command_t *handler, byte priority=0);
+   boolean command(const char *tag, revk_command_t *handler, byte priority=0);	// tag must stay valid
+   boolean reply(const __FlashStringHelper *fmt, ...);	// Publish info with tag of the command being run (use info() to reply later)
    boolean setting(const __FlashStringHelper *tag,const char*value); // Apply a setting (gets written to EEPROM)
    boolean setting(const __FlashStringHelper *tag,const byte*value=NULL,size_t len=0); // Apply a setting (gets written to EEPROM)
-   boolean ota(int delay=0);	// Do upgrade
+   boolean ota(int delay=0);	// Do upgrade (in background from loop, app_command("ota") when ready, then reboots)
+   void otahold(boolean hold=true);	// Hold back reboot in to new image until released, e.g. while busy
    boolean restart(int delay=0);	// Save settings and restart
    void sleep(unsigned long s);	// Got to sleep
    void mqttclose(const __FlashStringHelper *reason=NULL); // Close (will typically reopen on next loop)